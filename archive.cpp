@@ -0,0 +1,184 @@
+#include "archive.h"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <mz.h>
+#include <mz_strm.h>
+#include <mz_strm_os.h>
+#include <mz_zip.h>
+#include <mz_zip_rw.h>
+
+ZipReader::ZipReader(const char* path)
+  : zip_reader(NULL), file_stream(NULL)
+{
+  mz_zip_reader_create(&zip_reader);
+  mz_stream_os_create(&file_stream);
+
+  err = mz_stream_os_open(file_stream, path, MZ_OPEN_MODE_READ);
+  if (err == MZ_OK) {
+    err = mz_zip_reader_open(zip_reader, file_stream);
+  }
+}
+
+ZipReader::ZipReader(const void* data, int32_t size)
+  : zip_reader(NULL), file_stream(NULL)
+{
+  mz_zip_reader_create(&zip_reader);
+  err = mz_zip_reader_open_buffer(zip_reader, static_cast<uint8_t*>(const_cast<void*>(data)), size, 0);
+}
+
+ZipReader::~ZipReader()
+{
+  mz_zip_reader_close(zip_reader);
+  if (file_stream) {
+    mz_stream_os_close(file_stream);
+    mz_stream_os_delete(&file_stream);
+  }
+  mz_zip_reader_delete(&zip_reader);
+}
+
+std::vector<ZipEntry> ZipReader::entries()
+{
+  std::vector<ZipEntry> list;
+  void* zip = NULL;
+  if (mz_zip_reader_get_zip_handle(zip_reader, &zip) != MZ_OK) {
+    return list;
+  }
+  auto e = mz_zip_goto_first_entry(zip);
+  while (e == MZ_OK) {
+    mz_zip_file* info = NULL;
+    if (mz_zip_entry_get_info(zip, &info) == MZ_OK && mz_zip_entry_is_dir(zip) != MZ_OK) {
+      list.push_back({ info->filename, mz_zip_get_entry(zip), info->uncompressed_size, info->crc });
+    }
+    e = mz_zip_goto_next_entry(zip);
+  }
+  return list;
+}
+
+int32_t ZipReader::read(const ZipEntry& entry, std::vector<char>& buffer, int64_t max_bytes)
+{
+  void* zip = NULL;
+  auto e = mz_zip_reader_get_zip_handle(zip_reader, &zip);
+  if (e == MZ_OK) {
+    e = mz_zip_goto_entry(zip, entry.cd_pos);
+  }
+  if (e == MZ_OK) {
+    e = mz_zip_entry_read_open(zip, 0, NULL);
+  }
+  if (e != MZ_OK) {
+    buffer.clear();
+    return e;
+  }
+  auto size = entry.uncompressed_size;
+  if (max_bytes >= 0 && max_bytes < size) {
+    size = max_bytes;
+  }
+  buffer.resize(size);
+  int64_t total = 0;
+  while (total < size) {
+    auto chunk = static_cast<int32_t>(std::min<int64_t>(size - total, std::numeric_limits<int32_t>::max()));
+    auto n = mz_zip_entry_read(zip, buffer.data() + total, chunk);
+    if (n < 0) {
+      e = n;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    total += n;
+  }
+  buffer.resize(total);
+  // closing verifies the CRC, which can only be done for entries inflated as a whole
+  auto closed = mz_zip_entry_close(zip);
+  if (e == MZ_OK && size == entry.uncompressed_size) {
+    e = total != size ? MZ_DATA_ERROR : closed;
+  }
+  return e;
+}
+
+ZipReaderPool::ZipReaderPool(const std::string& path)
+  : filename(path)
+{
+}
+
+ZipReaderPool::ZipReaderPool(const void* data, size_t size)
+  : filename("<memory>"), data(data), size(static_cast<int32_t>(size))
+{
+  if (size > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+    throw std::runtime_error("Archives in memory must be smaller than 2 GiB");
+  }
+}
+
+ZipReaderPool::Handle ZipReaderPool::acquire()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!idle.empty()) {
+      auto reader = std::move(idle.back());
+      idle.pop_back();
+      return Handle(*this, std::move(reader));
+    }
+  }
+  auto reader = data ? std::make_unique<ZipReader>(data, size) : std::make_unique<ZipReader>(filename.c_str());
+  if (reader->err != MZ_OK) {
+    throw std::runtime_error("MZ error:" + std::to_string(reader->err) + " " + filename);
+  }
+  return Handle(*this, std::move(reader));
+}
+
+ZipReaderPool::Handle::Handle(ZipReaderPool& pool, std::unique_ptr<ZipReader> reader)
+  : pool(&pool), reader(std::move(reader))
+{
+}
+
+ZipReaderPool::Handle::~Handle()
+{
+  if (reader) {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->idle.push_back(std::move(reader));
+  }
+}
+
+MemoryStreamBuf::MemoryStreamBuf(const char* data, size_t size)
+{
+  auto p = const_cast<char*>(data);
+  setg(p, p, p + size);
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+  char* base;
+  switch (dir) {
+  case std::ios_base::beg:
+    base = eback();
+    break;
+  case std::ios_base::cur:
+    base = gptr();
+    break;
+  default:
+    base = egptr();
+    break;
+  }
+  auto p = base + off;
+  if (!(which & std::ios_base::in) || p < eback() || p > egptr()) {
+    return pos_type(off_type(-1));
+  }
+  setg(eback(), p, egptr());
+  return pos_type(p - eback());
+}
+
+MemoryStreamBuf::pos_type MemoryStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which)
+{
+  return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+MemoryInputStream::MemoryInputStream(const char* data, size_t size)
+  : std::istream(nullptr), buf(data, size)
+{
+  rdbuf(&buf);
+}
+
+MemoryInputStream::MemoryInputStream(const std::vector<char>& buffer)
+  : MemoryInputStream(buffer.data(), buffer.size())
+{
+}
@@ -0,0 +1,110 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+struct ZipEntry {
+  std::string name;
+  int64_t cd_pos; // position of the entry in the central directory
+  int64_t uncompressed_size;
+  uint32_t crc;
+};
+
+class ZipReader
+{
+public:
+  void* zip_reader;
+  void* file_stream;
+  int32_t err;
+  ZipReader(const char* path);
+  /// <summary>
+  /// Open an archive in memory. The data is not copied and must outlive the reader.
+  /// </summary>
+  ZipReader(const void* data, int32_t size);
+  ~ZipReader();
+
+  /// <summary>
+  /// List file entries (directories are skipped) in central directory order.
+  /// </summary>
+  std::vector<ZipEntry> entries();
+
+  /// <summary>
+  /// Inflate an entry into memory. At most max_bytes are inflated when max_bytes >= 0.
+  /// The CRC is checked when the whole entry is inflated, and a truncated entry is an error.
+  /// </summary>
+  /// <returns>MZ_OK or minizip error code</returns>
+  int32_t read(const ZipEntry& entry, std::vector<char>& buffer, int64_t max_bytes = -1);
+};
+
+/// <summary>
+/// ZipReader handles of one archive shared by threads. A minizip handle must not be used by two threads
+/// at a time, so each thread borrows its own handle. Handles are opened on demand and reused.
+/// </summary>
+class ZipReaderPool
+{
+public:
+  explicit ZipReaderPool(const std::string& path);
+  /// <summary>
+  /// Archive in memory, which must outlive the pool. std::runtime_error is thrown if it is 2 GiB or larger.
+  /// </summary>
+  ZipReaderPool(const void* data, size_t size);
+
+  /// <summary>
+  /// Handle borrowed from the pool. It is returned to the pool on destruction.
+  /// </summary>
+  class Handle
+  {
+  public:
+    Handle(ZipReaderPool& pool, std::unique_ptr<ZipReader> reader);
+    Handle(Handle&&) = default;
+    ~Handle();
+    ZipReader& operator*() const { return *reader; }
+    ZipReader* operator->() const { return reader.get(); }
+  private:
+    ZipReaderPool* pool;
+    std::unique_ptr<ZipReader> reader;
+  };
+
+  /// <summary>
+  /// std::runtime_error is thrown if the archive can't be opened.
+  /// </summary>
+  Handle acquire();
+
+  /// <returns>"<memory>" for an archive in memory</returns>
+  const std::string& path() const { return filename; }
+
+private:
+  std::string filename;
+  const void* data = nullptr; // archive in memory
+  int32_t size = 0;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ZipReader>> idle;
+};
+
+/// <summary>
+/// Read-only seekable stream over a memory block. The memory is not copied.
+/// </summary>
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+  MemoryStreamBuf(const char* data, size_t size);
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+class MemoryInputStream : public std::istream
+{
+public:
+  MemoryInputStream(const char* data, size_t size);
+  MemoryInputStream(const std::vector<char>& buffer);
+private:
+  MemoryStreamBuf buf;
+};
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,556 @@
+#include <gdcmImageWriter.h>
+#include <gdcmImageChangeTransferSyntax.h>
+#include <gdcmSequenceOfItems.h>
+#include <mz.h>
+#include <mz_zip.h>
+#include <mz_zip_rw.h>
+#include <tclap/CmdLine.h>
+#include <config.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <type_traits>
+#include "utils.h"
+#include "archive.h"
+#include "series.h"
+#include "volume.h"
+#include "compress.h"
+#include "image_writer.h"
+#include "rescale_simd.h"
+
+namespace fs = std::filesystem;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+struct BenchArgs {
+  fs::path workdir;
+  unsigned slices;
+  unsigned size;
+  unsigned threads;
+  unsigned repeat;
+  int level;
+  bool keep;
+};
+
+/// <summary>
+/// Kind of synthetic series
+/// </summary>
+struct Dataset {
+  std::string name;
+  std::string modality;
+  gdcm::TransferSyntax::TSType transfer_syntax;
+};
+
+const std::vector<Dataset> datasets = {
+  { "ct", "CT", gdcm::TransferSyntax::ExplicitVRLittleEndian },
+  { "pt", "PT", gdcm::TransferSyntax::ExplicitVRLittleEndian },
+  { "rgb", "OT", gdcm::TransferSyntax::ExplicitVRLittleEndian },
+  { "ct_rle", "CT", gdcm::TransferSyntax::RLELossless },
+  { "ct_jpegls", "CT", gdcm::TransferSyntax::JPEGLSLossless },
+  { "ct_j2k", "CT", gdcm::TransferSyntax::JPEG2000Lossless },
+};
+
+gdcm::DataElement string_element(uint16_t group, uint16_t element, gdcm::VR vr, std::string value)
+{
+  if (value.size() % 2) { // values have even length
+    value.push_back(vr == gdcm::VR::UI ? '\0' : ' ');
+  }
+  gdcm::DataElement de(gdcm::Tag(group, element));
+  de.SetVR(vr);
+  de.SetByteValue(value.data(), static_cast<uint32_t>(value.size()));
+  return de;
+}
+
+/// <summary>
+/// Pixel values of a phantom: a noisy disk whose contrast changes along z
+/// </summary>
+std::vector<char> phantom(const Dataset& dataset, unsigned size, unsigned z, unsigned slices)
+{
+  const unsigned spp = dataset.modality == "OT" ? 3 : 1;
+  const size_t n = size_t(size) * size;
+  std::vector<char> buffer(n * (dataset.modality == "OT" ? spp : 2));
+  uint32_t seed = 12345 + z;
+  auto noise = [&seed]() {
+    seed = seed * 1664525u + 1013904223u;
+    return int((seed >> 16) & 0x1f) - 16;
+  };
+  const double c = size / 2.0;
+  const double zc = slices / 2.0;
+  for (unsigned y = 0; y < size; ++y) {
+    for (unsigned x = 0; x < size; ++x) {
+      auto r = std::sqrt((x - c) * (x - c) + (y - c) * (y - c)) / c;
+      auto i = size_t(y) * size + x;
+      if (dataset.modality == "CT") { // stored value = HU + 1024
+        int hu = r < 0.8 ? 40 + int(200 * std::cos(r * 6 + z * 0.05)) + noise() : -1000;
+        reinterpret_cast<int16_t*>(buffer.data())[i] = static_cast<int16_t>(hu + 1024);
+      }
+      else if (dataset.modality == "PT") {
+        auto d = r * r + (z - zc) * (z - zc) / (zc * zc + 1);
+        int v = std::max(0, int(20000 * std::exp(-4 * d)) + 10 * noise());
+        reinterpret_cast<uint16_t*>(buffer.data())[i] = static_cast<uint16_t>(std::min(v, 65535));
+      }
+      else {
+        auto b = reinterpret_cast<uint8_t*>(buffer.data()) + i * 3;
+        b[0] = static_cast<uint8_t>(x * 255 / size);
+        b[1] = static_cast<uint8_t>(y * 255 / size);
+        b[2] = static_cast<uint8_t>(r < 0.8 ? 200 + noise() : z % 256);
+      }
+    }
+  }
+  return buffer;
+}
+
+/// <summary>
+/// Write a series of single frame files named 0000.dcm, 0001.dcm, ... into dir
+/// </summary>
+void generate_series(const Dataset& dataset, const fs::path& dir, unsigned slices, unsigned size, unsigned index)
+{
+  fs::create_directories(dir);
+  const std::string uid_root = "2.25." + std::to_string(1000 + index);
+  for (unsigned z = 0; z < slices; ++z) {
+    gdcm::ImageWriter writer;
+    auto& image = writer.GetImage();
+    image.SetNumberOfDimensions(2);
+    image.SetDimension(0, size);
+    image.SetDimension(1, size);
+    if (dataset.modality == "CT") {
+      image.SetPixelFormat(gdcm::PixelFormat(gdcm::PixelFormat::INT16));
+      image.SetPhotometricInterpretation(gdcm::PhotometricInterpretation::MONOCHROME2);
+      image.SetIntercept(-1024);
+      image.SetSlope(1);
+    }
+    else if (dataset.modality == "PT") {
+      image.SetPixelFormat(gdcm::PixelFormat(gdcm::PixelFormat::UINT16));
+      image.SetPhotometricInterpretation(gdcm::PhotometricInterpretation::MONOCHROME2);
+      image.SetIntercept(0);
+      image.SetSlope(0.25);
+    }
+    else {
+      gdcm::PixelFormat pf(gdcm::PixelFormat::UINT8);
+      pf.SetSamplesPerPixel(3);
+      image.SetPixelFormat(pf);
+      image.SetPhotometricInterpretation(gdcm::PhotometricInterpretation::RGB);
+      image.SetPlanarConfiguration(0);
+    }
+    const double origin[3] = { -0.35 * size, -0.35 * size, 2.5 * z };
+    const double cosines[6] = { 1, 0, 0, 0, 1, 0 };
+    const double spacing[3] = { 0.7, 0.7, 2.5 };
+    image.SetOrigin(origin);
+    image.SetDirectionCosines(cosines);
+    image.SetSpacing(spacing);
+    image.SetTransferSyntax(gdcm::TransferSyntax::ExplicitVRLittleEndian);
+    auto pixels = phantom(dataset, size, z, slices);
+    gdcm::DataElement pixeldata(gdcm::Tag(0x7fe0, 0x0010));
+    pixeldata.SetByteValue(pixels.data(), static_cast<uint32_t>(pixels.size()));
+    image.SetDataElement(pixeldata);
+
+    auto& ds = writer.GetFile().GetDataSet();
+    const std::string sop_class = dataset.modality == "CT" ? "1.2.840.10008.5.1.4.1.1.2"
+      : dataset.modality == "PT" ? "1.2.840.10008.5.1.4.1.1.128" : "1.2.840.10008.5.1.4.1.1.7";
+    ds.Replace(string_element(0x0008, 0x0016, gdcm::VR::UI, sop_class));
+    ds.Replace(string_element(0x0008, 0x0018, gdcm::VR::UI, uid_root + ".3." + std::to_string(z + 1)));
+    ds.Replace(string_element(0x0008, 0x0021, gdcm::VR::DA, "20200101"));
+    ds.Replace(string_element(0x0008, 0x0031, gdcm::VR::TM, "100000"));
+    ds.Replace(string_element(0x0008, 0x0060, gdcm::VR::CS, dataset.modality));
+    ds.Replace(string_element(0x0008, 0x103e, gdcm::VR::LO, "bench " + dataset.name));
+    ds.Replace(string_element(0x0020, 0x000d, gdcm::VR::UI, uid_root + ".1"));
+    ds.Replace(string_element(0x0020, 0x000e, gdcm::VR::UI, uid_root + ".2"));
+    ds.Replace(string_element(0x0020, 0x0011, gdcm::VR::IS, std::to_string(index + 1)));
+    ds.Replace(string_element(0x0020, 0x0013, gdcm::VR::IS, std::to_string(z + 1)));
+    if (dataset.modality == "PT") {
+      ds.Replace(string_element(0x0010, 0x1030, gdcm::VR::DS, "70"));
+      ds.Replace(string_element(0x0054, 0x1001, gdcm::VR::CS, "BQML"));
+      ds.Replace(string_element(0x0054, 0x1102, gdcm::VR::CS, "START"));
+      gdcm::Item item;
+      item.SetVLToUndefined();
+      auto& nested = item.GetNestedDataSet();
+      nested.Insert(string_element(0x0018, 0x1072, gdcm::VR::TM, "090000"));
+      nested.Insert(string_element(0x0018, 0x1074, gdcm::VR::DS, "370000000"));
+      nested.Insert(string_element(0x0018, 0x1075, gdcm::VR::DS, "6586.2"));
+      gdcm::SmartPointer<gdcm::SequenceOfItems> sq = new gdcm::SequenceOfItems;
+      sq->SetLengthToUndefined();
+      sq->AddItem(item);
+      gdcm::DataElement de(gdcm::Tag(0x0054, 0x0016));
+      de.SetVR(gdcm::VR::SQ);
+      de.SetValue(*sq);
+      de.SetVLToUndefined();
+      ds.Replace(de);
+    }
+
+    if (dataset.transfer_syntax != gdcm::TransferSyntax::ExplicitVRLittleEndian) {
+      gdcm::ImageChangeTransferSyntax change;
+      change.SetTransferSyntax(dataset.transfer_syntax);
+      change.SetInput(image);
+      if (!change.Change()) {
+        throw std::runtime_error("Could not compress: " + dataset.name);
+      }
+      writer.SetImage(change.GetOutput());
+    }
+    char filename[16];
+    snprintf(filename, sizeof(filename), "%04u.dcm", z);
+    writer.SetFileName((dir / filename).string().c_str());
+    if (!writer.Write()) {
+      throw std::runtime_error("Could not write: " + (dir / filename).string());
+    }
+  }
+}
+
+void zip_directory(const fs::path& dir, const fs::path& zip_path)
+{
+  void* writer = NULL;
+  mz_zip_writer_create(&writer);
+  auto err = mz_zip_writer_open_file(writer, zip_path.string().c_str(), 0, 0);
+  for (const auto& entry : fs::directory_iterator(dir)) {
+    if (err != MZ_OK) {
+      break;
+    }
+    err = mz_zip_writer_add_file(writer, entry.path().string().c_str(), entry.path().filename().string().c_str());
+  }
+  auto close_err = mz_zip_writer_close(writer);
+  mz_zip_writer_delete(&writer);
+  if (err != MZ_OK || close_err != MZ_OK) {
+    throw std::runtime_error("Could not create: " + zip_path.string());
+  }
+}
+
+/// <summary>
+/// Discards output and counts bytes
+/// </summary>
+class CountingStreamBuf : public std::streambuf
+{
+public:
+  uint64_t count = 0;
+protected:
+  std::streamsize xsputn(const char*, std::streamsize n) override
+  {
+    count += n;
+    return n;
+  }
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      ++count;
+    }
+    return traits_type::not_eof(c);
+  }
+};
+
+using Stages = std::map<std::string, double>;
+
+template <typename F>
+double seconds(F&& f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Result {
+  std::string dataset;
+  std::string input; // directory or zip
+  size_t files = 0;
+  uint64_t input_bytes = 0;
+  uint64_t voxels = 0;
+  uint64_t compressed_bytes = 0;
+  Stages stages; // seconds, the best of the repeats
+};
+
+/// <summary>
+/// decode, (suv,) compress and write stages of a grouped series
+/// </summary>
+template <typename ImageType>
+void run_image_stages(const BenchArgs& args, const Series& series, const SliceReadFn& read_slice, unsigned decode_threads, const fs::path& output, Result& result, Stages& stages)
+{
+  typename ImageType::Pointer image;
+  stages["decode"] = seconds([&]() { image = read_volume<ImageType>(series, read_slice, decode_threads, true); });
+  using Pixel = typename ImageType::PixelType;
+  const auto n_pixels = image->GetBufferedRegion().GetNumberOfPixels();
+  if constexpr (std::is_floating_point_v<Pixel>) {
+    if (series.slices.front().modality == "PT") {
+      stages["suv"] = seconds([&]() {
+        auto factor = calculate_bw_factor(series.slices.front().suv);
+        scale_buffer(image->GetBufferPointer(), n_pixels, static_cast<Pixel>(factor));
+      });
+    }
+  }
+  result.voxels = n_pixels;
+  CompressOptions options;
+  options.level = args.level;
+  options.threads = args.threads;
+  stages["compress"] = seconds([&]() {
+    CountingStreamBuf buf;
+    std::ostream os(&buf);
+    auto data = reinterpret_cast<const char*>(image->GetBufferPointer());
+    result.compressed_bytes = parallel_deflate(os, { { data, n_pixels * sizeof(Pixel) } }, DeflateWrapper::gzip, options.level, options.threads);
+  });
+  stages["write"] = seconds([&]() {
+    write_compressed(image.GetPointer(), output.string(), true, options);
+  });
+}
+
+template <typename ImageType>
+Result bench_directory(const BenchArgs& args, const Dataset& dataset, const fs::path& dir)
+{
+  Result result{ dataset.name, "directory" };
+  for (unsigned r = 0; r < args.repeat; ++r) {
+    Stages stages;
+    stages["scan"] = seconds([&]() {
+      result.files = 0;
+      result.input_bytes = 0;
+      for (const auto& entry : fs::recursive_directory_iterator(dir)) {
+        if (entry.is_regular_file()) {
+          ++result.files;
+          result.input_bytes += entry.file_size();
+        }
+      }
+    });
+    std::vector<Series> series;
+    stages["parse"] = seconds([&]() { series = group_series(scan_directory(dir.string(), args.threads)); });
+    if (series.size() != 1) {
+      throw std::runtime_error("Unexpected number of series: " + dataset.name);
+    }
+    auto read_slice = [](const SliceHeader& h, gdcm::ImageReader& reader) {
+      reader.SetFileName(h.filename.c_str());
+      return reader.Read();
+    };
+    run_image_stages<ImageType>(args, series.front(), read_slice, args.threads, args.workdir / (dataset.name + "_dir.nii.gz"), result, stages);
+    for (const auto& s : stages) {
+      result.stages[s.first] = r == 0 ? s.second : std::min(result.stages[s.first], s.second);
+    }
+  }
+  return result;
+}
+
+template <typename ImageType>
+Result bench_zip(const BenchArgs& args, const Dataset& dataset, const fs::path& zip_path)
+{
+  Result result{ dataset.name, "zip" };
+  result.input_bytes = fs::file_size(zip_path);
+  for (unsigned r = 0; r < args.repeat; ++r) {
+    Stages stages;
+    ZipReaderPool zip(zip_path.string());
+    std::vector<ZipEntry> entries;
+    stages["scan"] = seconds([&]() { entries = zip.acquire()->entries(); });
+    result.files = entries.size();
+    std::vector<Series> series;
+    stages["parse"] = seconds([&]() { series = group_series(scan_zip(zip, entries, args.threads)); });
+    if (series.size() != 1) {
+      throw std::runtime_error("Unexpected number of series: " + dataset.name);
+    }
+    auto read_slice = [&](const SliceHeader& h, gdcm::ImageReader& r) { return read_zip_slice(zip, entries, h, r); };
+    run_image_stages<ImageType>(args, series.front(), read_slice, args.threads, args.workdir / (dataset.name + "_zip.nii.gz"), result, stages);
+    for (const auto& s : stages) {
+      result.stages[s.first] = r == 0 ? s.second : std::min(result.stages[s.first], s.second);
+    }
+  }
+  return result;
+}
+
+template <typename ImageType>
+std::vector<Result> bench(const BenchArgs& args, const Dataset& dataset, unsigned index)
+{
+  auto dir = args.workdir / dataset.name;
+  auto zip_path = args.workdir / (dataset.name + ".zip");
+  cerr << "Generating: " << dataset.name << endl;
+  fs::remove_all(dir);
+  fs::remove(zip_path);
+  generate_series(dataset, dir, args.slices, args.size, index);
+  zip_directory(dir, zip_path);
+  cerr << "Benchmarking: " << dataset.name << endl;
+  return { bench_directory<ImageType>(args, dataset, dir), bench_zip<ImageType>(args, dataset, zip_path) };
+}
+
+/// <summary>
+/// Compare the AVX2 kernel of a pair of types bit for bit with the scalar loop of rescale_copy over all input values.
+/// </summary>
+/// <returns>number of mismatched values, or -1 if the CPU lacks AVX2</returns>
+template <typename TIn, typename TOut>
+long long check_rescale_kernel(double slope, double intercept)
+{
+  constexpr size_t n = size_t(1) << 16;
+  std::vector<TIn> in(n);
+  for (size_t i = 0; i < n; ++i) {
+    in[i] = static_cast<TIn>(static_cast<uint16_t>(i));
+  }
+  std::vector<TOut> expected(n);
+  for (size_t i = 0; i < n; ++i) {
+    if constexpr (std::is_floating_point_v<TOut>) {
+      expected[i] = static_cast<TOut>(in[i] * slope + intercept);
+    }
+    else {
+      expected[i] = saturate<TOut>(in[i] * slope + intercept);
+    }
+  }
+  std::vector<TOut> out(n);
+  const auto written = rescale_copy_avx2(in.data(), out.data(), n, slope, intercept);
+  if (written == 0) {
+    return -1;
+  }
+  long long mismatches = static_cast<long long>(n - written); // values left to the scalar loop are not covered
+  for (size_t i = 0; i < written; ++i) {
+    if (std::memcmp(&out[i], &expected[i], sizeof(TOut)) != 0) {
+      if (mismatches++ == 0) {
+        cout << "  first mismatch: " << +in[i] << " * " << slope << " + " << intercept << " = " << +out[i]
+          << ", expected " << +expected[i] << endl;
+      }
+    }
+  }
+  return mismatches;
+}
+
+/// <summary>
+/// Check the AVX2 rescaling kernels against the scalar loop with slopes and intercepts of CT and PET series,
+/// rounding ties, values which saturate and non-finite values read from broken headers.
+/// </summary>
+/// <returns>false on any mismatch</returns>
+bool check_rescale_simd()
+{
+  const std::pair<double, double> rescales[] = {
+    { 1.0, 0.0 }, { 1.0, -1024.0 }, { 1.0, -32768.0 }, { 1.0, 32768.0 }, { -1.0, 0.0 }, { 0.5, 0.5 }, { 0.5, -0.5 },
+    { 2.5, -1024.25 }, { 0.3477, 12.5 }, { 1e-3, 0.0 }, { 1e5, -7.0 }, { 1.0 / 3.0, 1.0 / 3.0 },
+    { std::numeric_limits<double>::quiet_NaN(), 0.0 }, { 1.0, std::numeric_limits<double>::quiet_NaN() },
+    { std::numeric_limits<double>::infinity(), 0.0 }, { -std::numeric_limits<double>::infinity(), -1024.0 } };
+  bool ok = true;
+  auto check = [&ok, &rescales](const char* name, auto kernel) {
+    bool identical = true;
+    for (const auto& r : rescales) {
+      auto mismatches = kernel(r.first, r.second);
+      if (mismatches < 0) {
+        cout << name << ": AVX2 not supported by the CPU, skipped" << endl;
+        return;
+      }
+      if (mismatches > 0) {
+        cout << name << ": " << mismatches << " mismatches with slope " << r.first << ", intercept " << r.second << endl;
+        identical = false;
+      }
+    }
+    if (identical) {
+      cout << name << ": identical" << endl;
+    }
+    ok = ok && identical;
+  };
+  check("int16 -> float", check_rescale_kernel<int16_t, float>);
+  check("int16 -> double", check_rescale_kernel<int16_t, double>);
+  check("int16 -> int16", check_rescale_kernel<int16_t, int16_t>);
+  check("int16 -> uint16", check_rescale_kernel<int16_t, uint16_t>);
+  check("uint16 -> float", check_rescale_kernel<uint16_t, float>);
+  check("uint16 -> double", check_rescale_kernel<uint16_t, double>);
+  check("uint16 -> int16", check_rescale_kernel<uint16_t, int16_t>);
+  check("uint16 -> uint16", check_rescale_kernel<uint16_t, uint16_t>);
+  return ok;
+}
+
+void write_json(std::ostream& os, const BenchArgs& args, const std::vector<Result>& results)
+{
+  os << std::setprecision(6);
+  os << "{\n";
+  os << "  \"version\": \"" << PROJECT_VERSION << "\",\n";
+  os << "  \"slices\": " << args.slices << ",\n";
+  os << "  \"size\": " << args.size << ",\n";
+  os << "  \"threads\": " << args.threads << ",\n";
+  os << "  \"repeat\": " << args.repeat << ",\n";
+  os << "  \"compress_level\": " << args.level << ",\n";
+  os << "  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    os << (i == 0 ? "\n" : ",\n");
+    os << "    {\"dataset\": \"" << r.dataset << "\", \"input\": \"" << r.input << "\", \"files\": " << r.files
+      << ", \"input_bytes\": " << r.input_bytes << ", \"voxels\": " << r.voxels << ", \"compressed_bytes\": " << r.compressed_bytes
+      << ", \"seconds\": {";
+    bool first = true;
+    for (const auto& s : r.stages) {
+      os << (first ? "" : ", ") << "\"" << s.first << "\": " << s.second;
+      first = false;
+    }
+    os << "}}";
+  }
+  os << "\n  ]\n}\n";
+}
+
+int main(int argc, char* argv[])
+{
+  try {
+    TCLAP::CmdLine cmd("dcm2itk benchmark on synthetic DICOM series", ' ', PROJECT_VERSION);
+    std::string names;
+    for (const auto& d : datasets) {
+      names += (names.empty() ? "" : ",") + d.name;
+    }
+    TCLAP::ValueArg<std::string> datasetsArg("", "datasets", "Comma separated datasets. default: " + names, false, names, "names", cmd);
+    TCLAP::ValueArg<unsigned> slicesArg("", "slices", "Number of slices per series. default: 100", false, 100, "N", cmd);
+    TCLAP::ValueArg<unsigned> sizeArg("", "size", "Matrix size (rows and columns). default: 512", false, 512, "N", cmd);
+    TCLAP::ValueArg<unsigned> threadsArg("", "threads", "Number of threads for parsing, decoding and compression. 0 uses all cores. default: 0", false, 0, "N", cmd);
+    TCLAP::ValueArg<unsigned> repeatArg("", "repeat", "Number of runs. The fastest run of each stage is reported. default: 3", false, 3, "N", cmd);
+    TCLAP::ValueArg<int> levelArg("", "compress-level", "zlib compression level. default: 6", false, 6, "level", cmd);
+    TCLAP::ValueArg<std::string> workdirArg("", "workdir", "Directory where dcm2itk_bench/ is created for generated series and outputs. default: system temporary directory", false, "", "dirname", cmd);
+    TCLAP::SwitchArg keepSwitch("", "keep", "Keep generated files.", cmd, false);
+    TCLAP::ValueArg<std::string> outputArg("o", "output", "(optional) JSON output file. default: stdout", false, "", "filename", cmd);
+    TCLAP::SwitchArg checkSimdSwitch("", "check-simd", "Compare the AVX2 rescaling kernels bit for bit with the scalar loop over all 16 bit values and exit. The exit code is nonzero on any mismatch.", cmd, false);
+    cmd.parse(argc, argv);
+
+    if (checkSimdSwitch) {
+      return check_rescale_simd() ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    BenchArgs args;
+    // generated files are kept in a subdirectory of their own so that --keep off never removes anything else
+    args.workdir = (workdirArg.isSet() ? fs::path(workdirArg.getValue()) : fs::temp_directory_path()) / "dcm2itk_bench";
+    args.slices = std::max(1u, slicesArg.getValue());
+    args.size = std::max(1u, sizeArg.getValue());
+    args.threads = threadsArg.getValue();
+    args.repeat = std::max(1u, repeatArg.getValue());
+    args.level = levelArg.getValue();
+    args.keep = keepSwitch;
+    fs::create_directories(args.workdir);
+
+    std::vector<Result> results;
+    std::stringstream ss(datasetsArg.getValue());
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+      auto it = std::find_if(datasets.begin(), datasets.end(), [&name](const Dataset& d) { return d.name == name; });
+      if (it == datasets.end()) {
+        cerr << "Unknown dataset: " << name << endl;
+        return EXIT_FAILURE;
+      }
+      std::vector<Result> r;
+      auto index = static_cast<unsigned>(it - datasets.begin());
+      if (it->modality == "CT") {
+        r = bench<itk::Image<int16_t, 3>>(args, *it, index);
+      }
+      else if (it->modality == "PT") {
+        r = bench<itk::Image<float, 3>>(args, *it, index);
+      }
+      else {
+        r = bench<itk::Image<itk::RGBPixel<uint8_t>, 3>>(args, *it, index);
+      }
+      results.insert(results.end(), r.begin(), r.end());
+    }
+
+    if (outputArg.isSet()) {
+      std::ofstream ofs(outputArg.getValue());
+      write_json(ofs, args, results);
+    }
+    else {
+      write_json(cout, args, results);
+    }
+    if (!args.keep) {
+      fs::remove_all(args.workdir);
+    }
+  }
+  catch (TCLAP::ArgException& e) {
+    cerr << "error: " << e.error() << " for arg " << e.argId() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::exception& e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
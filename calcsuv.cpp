@@ -2,27 +2,212 @@
 #include <gdcmImageReader.h>
 #include <gdcmWriter.h>
 #include <tclap/CmdLine.h>
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include "config.h"
 #include "utils.h"
+#include "archive.h"
+#include "series.h"
+#include "thread_pool.h"
 
 using std::cout;
 using std::cerr;
 using std::endl;
+namespace fs = std::filesystem;
+
+/// <summary>
+/// SUVbwScaleFactor of a series
+/// </summary>
+struct SeriesSuv
+{
+  const Series* series;
+  double factor = 0;
+  SuvParams params;                   // of the slice the factor is computed from
+  std::string error;                  // no slice has the SUV attributes
+  std::vector<std::string> differing; // slices without the attributes or with another factor
+};
+
+/// <summary>
+/// Compute the factor of every slice from the parsed headers. The factor of the series is that of the
+/// first slice which has one, and slices whose factor differs from it by more than 1e-6 (relative) are flagged.
+/// </summary>
+SeriesSuv series_suv(const Series& series)
+{
+  SeriesSuv result{ &series };
+  const auto n = series.slices.size();
+  std::vector<double> factors(n, 0.0);
+  std::vector<std::string> errors(n);
+  for (size_t i = 0; i < n; ++i) {
+    const auto& slice = series.slices[i];
+    errors[i] = slice.suv_error;
+    if (errors[i].empty()) {
+      try {
+        factors[i] = calculate_bw_factor(slice.suv);
+      }
+      catch (std::exception& ex) {
+        errors[i] = ex.what();
+      }
+    }
+  }
+  auto reference = std::find(errors.begin(), errors.end(), std::string()) - errors.begin();
+  if (static_cast<size_t>(reference) == n) {
+    result.error = errors.front();
+    return result;
+  }
+  result.factor = factors[reference];
+  result.params = series.slices[reference].suv;
+  for (size_t i = 0; i < n; ++i) {
+    if (!errors[i].empty() || std::abs(factors[i] - result.factor) > 1e-6 * std::abs(result.factor)) {
+      result.differing.push_back(series.slices[i].filename);
+    }
+  }
+  return result;
+}
+
+std::string csv_field(const std::string& s)
+{
+  if (s.find_first_of(",\"\r\n") == std::string::npos) {
+    return s;
+  }
+  std::string out = "\"";
+  for (auto c : s) {
+    out += c == '"' ? std::string("\"\"") : std::string(1, c);
+  }
+  return out + "\"";
+}
+
+void write_csv(std::ostream& os, const std::vector<SeriesSuv>& results)
+{
+  os << std::setprecision(10);
+  os << "series_uid,series_identifier,series_number,description,slices,factor,weight,dose,halflife,pharma_starttime,seriesdate,seriestime,differing_slices,error\n";
+  for (const auto& r : results) {
+    const auto& first = r.series->slices.front();
+    os << csv_field(first.series_uid) << "," << csv_field(r.series->identifier) << "," << csv_field(first.series_number) << ","
+      << csv_field(first.description) << "," << r.series->slices.size() << ",";
+    if (r.error.empty()) {
+      os << r.factor << "," << csv_field(r.params.weight) << "," << csv_field(r.params.dose) << "," << csv_field(r.params.halflife) << ","
+        << csv_field(r.params.pharma_starttime) << "," << csv_field(r.params.seriesdate) << "," << csv_field(r.params.seriestime) << ",";
+    }
+    else {
+      os << ",,,,,,,";
+    }
+    os << r.differing.size() << "," << csv_field(r.error) << "\n";
+  }
+}
+
+void write_json(std::ostream& os, const std::vector<SeriesSuv>& results)
+{
+  os << std::setprecision(10);
+  os << "[";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto& r = results[i];
+    const auto& first = r.series->slices.front();
+    os << (i == 0 ? "\n" : ",\n");
+    os << "  {\n";
+    os << "    \"series_uid\": " << json_string(first.series_uid) << ",\n";
+    os << "    \"series_identifier\": " << json_string(r.series->identifier) << ",\n";
+    os << "    \"series_number\": " << json_string(first.series_number) << ",\n";
+    os << "    \"description\": " << json_string(first.description) << ",\n";
+    os << "    \"slices\": " << r.series->slices.size() << ",\n";
+    if (r.error.empty()) {
+      os << "    \"factor\": " << r.factor << ",\n";
+      os << "    \"weight\": " << json_string(r.params.weight) << ",\n";
+      os << "    \"dose\": " << json_string(r.params.dose) << ",\n";
+      os << "    \"halflife\": " << json_string(r.params.halflife) << ",\n";
+      os << "    \"pharma_starttime\": " << json_string(r.params.pharma_starttime) << ",\n";
+      os << "    \"seriesdate\": " << json_string(r.params.seriesdate) << ",\n";
+      os << "    \"seriestime\": " << json_string(r.params.seriestime) << ",\n";
+    }
+    else {
+      os << "    \"error\": " << json_string(r.error) << ",\n";
+    }
+    os << "    \"differing_slices\": [";
+    for (size_t j = 0; j < r.differing.size(); ++j) {
+      os << (j == 0 ? "" : ", ") << json_string(r.differing[j]);
+    }
+    os << "]\n";
+    os << "  }";
+  }
+  os << "\n]\n";
+}
+
+/// <summary>
+/// Report the factor of every PET series in a directory or a zip file. Only headers are parsed.
+/// </summary>
+int batch_suv(const std::string& input, const std::string& format, const std::string& report, unsigned n_threads)
+{
+  std::vector<SliceHeader> headers;
+  if (fs::is_directory(input)) {
+    headers = scan_directory(input, n_threads);
+  }
+  else {
+    ZipReaderPool zip(input);
+    headers = scan_zip(zip, zip.acquire()->entries(), n_threads);
+  }
+  auto all_series = group_series(std::move(headers));
+  std::vector<const Series*> pet;
+  for (const auto& s : all_series) {
+    if (s.slices.front().modality == "PT") {
+      pet.push_back(&s);
+    }
+  }
+  cerr << pet.size() << " PET series (" << all_series.size() - pet.size() << " other series skipped)" << endl;
+
+  std::vector<SeriesSuv> results(pet.size());
+  parallel_for(pet.size(), n_threads, [&](size_t i) { results[i] = series_suv(*pet[i]); });
+
+  std::ofstream ofs;
+  if (!report.empty()) {
+    ofs.open(report);
+    if (!ofs) {
+      cerr << "Could not open: " << report << endl;
+      return 1;
+    }
+  }
+  std::ostream& os = report.empty() ? cout : ofs;
+  if (format == "json") {
+    write_json(os, results);
+  }
+  else {
+    write_csv(os, results);
+  }
+  if (!os) {
+    cerr << "Could not write: " << (report.empty() ? "stdout" : report) << endl;
+    return 1;
+  }
+  return 0;
+}
 
 int main(int argc, char* argv[])
 {
   try
   {
     TCLAP::CmdLine cmd("Calculate SUV factor", ' ', PROJECT_VERSION);
-    TCLAP::UnlabeledValueArg<std::string> input("input", "Input directory or zip file containing dicom files", true, "", "input", cmd);
-    TCLAP::ValueArg<std::string> output("", "output", "(optional) Output dicom with re-calculated rescale-slope.", false, "", "filename", cmd);
+    TCLAP::UnlabeledValueArg<std::string> input("input", "Input dicom file, or directory or zip file containing dicom files", true, "", "input", cmd);
+    TCLAP::ValueArg<std::string> output("", "output", "(optional) Output dicom with re-calculated rescale-slope. Single file input only.", false, "", "filename", cmd);
+    std::vector<std::string> formats{ "csv", "json" };
+    TCLAP::ValuesConstraint<std::string> formatConstraint(formats);
+    TCLAP::ValueArg<std::string> formatArg("", "format", "Report format of directory or zip input. default: csv", false, "csv", &formatConstraint, cmd);
+    TCLAP::ValueArg<std::string> reportArg("", "report", "(optional) Report file of directory or zip input. default: stdout", false, "", "filename", cmd);
+    TCLAP::ValueArg<unsigned> threadsArg("", "threads", "Number of threads parsing headers and computing factors. 0 uses all cores. default: 0", false, 0, "N", cmd);
 
     cmd.parse(argc, argv);
     auto input_filename = input.getValue();
     auto output_filename = output.getValue();
+    if (fs::is_directory(input_filename) || fs::path(input_filename).extension() == ".zip") {
+      if (output.isSet()) {
+        cerr << "--output is supported for single file input only." << endl;
+        return 1;
+      }
+      return batch_suv(input_filename, formatArg.getValue(), reportArg.getValue(), threadsArg.getValue());
+    }
     gdcm::Reader reader;
     reader.SetFileName(input_filename.c_str());
-    if (!reader.Read())
+    // the pixel data is needed only to write the output
+    if (!(output.isSet() ? reader.Read() : reader.ReadSelectedTags(suv_tags())))
     {
       cerr << "Could not read: " << input_filename << std::endl;
       return 1;
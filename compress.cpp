@@ -0,0 +1,132 @@
+#include "compress.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <zlib.h>
+
+namespace
+{
+  constexpr size_t window_size = 32768;
+
+  struct Block {
+    const char* data;
+    size_t size;
+    size_t dict_size; // bytes preceding data used as dictionary
+    bool last;
+  };
+
+  struct CompressedBlock {
+    std::vector<char> data;
+    uLong check; // crc32 or adler32 of the uncompressed block
+  };
+
+  CompressedBlock deflate_block(const Block& block, DeflateWrapper wrapper, int level)
+  {
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      throw std::runtime_error("deflateInit2 failed");
+    }
+    if (block.dict_size > 0) {
+      deflateSetDictionary(&strm, reinterpret_cast<const Bytef*>(block.data - block.dict_size), static_cast<uInt>(block.dict_size));
+    }
+    CompressedBlock out;
+    // room for the empty stored block emitted by Z_SYNC_FLUSH
+    out.data.resize(deflateBound(&strm, static_cast<uLong>(block.size)) + 16);
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.data));
+    strm.avail_in = static_cast<uInt>(block.size);
+    strm.next_out = reinterpret_cast<Bytef*>(out.data.data());
+    strm.avail_out = static_cast<uInt>(out.data.size());
+    auto ret = deflate(&strm, block.last ? Z_FINISH : Z_SYNC_FLUSH);
+    auto expected = block.last ? Z_STREAM_END : Z_OK;
+    out.data.resize(out.data.size() - strm.avail_out);
+    deflateEnd(&strm);
+    if (ret != expected || strm.avail_in != 0) {
+      throw std::runtime_error("deflate failed");
+    }
+    auto data = reinterpret_cast<const Bytef*>(block.data);
+    if (wrapper == DeflateWrapper::gzip) {
+      out.check = crc32(crc32(0L, Z_NULL, 0), data, static_cast<uInt>(block.size));
+    }
+    else {
+      out.check = adler32(adler32(0L, Z_NULL, 0), data, static_cast<uInt>(block.size));
+    }
+    return out;
+  }
+
+  void put_le32(std::ostream& os, uint32_t v)
+  {
+    char b[4] = { char(v & 0xff), char((v >> 8) & 0xff), char((v >> 16) & 0xff), char((v >> 24) & 0xff) };
+    os.write(b, 4);
+  }
+
+  void put_be32(std::ostream& os, uint32_t v)
+  {
+    char b[4] = { char((v >> 24) & 0xff), char((v >> 16) & 0xff), char((v >> 8) & 0xff), char(v & 0xff) };
+    os.write(b, 4);
+  }
+}
+
+uint64_t parallel_deflate(std::ostream& os, const std::vector<Span>& spans, DeflateWrapper wrapper, int level, unsigned n_threads, size_t block_size)
+{
+  std::vector<Block> blocks;
+  for (const auto& span : spans) {
+    for (size_t offset = 0; offset < span.second; offset += block_size) {
+      blocks.push_back({ span.first + offset, std::min(block_size, span.second - offset), std::min(window_size, offset), false });
+    }
+  }
+  if (blocks.empty()) {
+    blocks.push_back({ nullptr, 0, 0, false });
+  }
+  blocks.back().last = true;
+
+  uint64_t written = 0;
+  if (wrapper == DeflateWrapper::gzip) {
+    // magic, deflate, no flags, no mtime, no extra flags, unknown OS
+    const char header[10] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, '\xff' };
+    os.write(header, sizeof(header));
+    written += sizeof(header);
+  }
+  else {
+    const char header[2] = { '\x78', '\x9c' };
+    os.write(header, sizeof(header));
+    written += sizeof(header);
+  }
+
+  if (n_threads == 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // blocks are compressed in waves so that only a few compressed blocks are held in memory
+  const size_t wave = size_t(n_threads) * 4;
+  uLong check = wrapper == DeflateWrapper::gzip ? crc32(0L, Z_NULL, 0) : adler32(0L, Z_NULL, 0);
+  uint64_t total_in = 0;
+  std::vector<CompressedBlock> compressed;
+  for (size_t first = 0; first < blocks.size(); first += wave) {
+    auto n = std::min(wave, blocks.size() - first);
+    compressed.assign(n, CompressedBlock());
+    parallel_for(n, n_threads, [&](size_t i) {
+      compressed[i] = deflate_block(blocks[first + i], wrapper, level);
+    });
+    for (size_t i = 0; i < n; ++i) {
+      const auto& block = blocks[first + i];
+      os.write(compressed[i].data.data(), compressed[i].data.size());
+      written += compressed[i].data.size();
+      auto len = static_cast<z_off_t>(block.size);
+      check = wrapper == DeflateWrapper::gzip ? crc32_combine(check, compressed[i].check, len) : adler32_combine(check, compressed[i].check, len);
+      total_in += block.size;
+    }
+  }
+
+  if (wrapper == DeflateWrapper::gzip) {
+    put_le32(os, static_cast<uint32_t>(check));
+    put_le32(os, static_cast<uint32_t>(total_in & 0xffffffffu));
+  }
+  else {
+    put_be32(os, static_cast<uint32_t>(check));
+  }
+  written += wrapper == DeflateWrapper::gzip ? 8 : 4;
+  if (!os) {
+    throw std::runtime_error("Could not write compressed data");
+  }
+  return written;
+}
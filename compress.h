@@ -0,0 +1,21 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <cstdint>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+enum class DeflateWrapper { gzip, zlib };
+
+using Span = std::pair<const char*, size_t>;
+
+/// <summary>
+/// Deflate spans as one stream, compressing blocks concurrently in the manner of pigz, and write a single
+/// standard gzip member or zlib stream. Each block is primed with the preceding 32KB of its span.
+/// </summary>
+/// <param name="level">zlib compression level (0-9, -1 for default)</param>
+/// <param name="n_threads">0 uses all cores</param>
+/// <returns>number of bytes written</returns>
+uint64_t parallel_deflate(std::ostream& os, const std::vector<Span>& spans, DeflateWrapper wrapper, int level, unsigned n_threads, size_t block_size = 1 << 20);
+
+#endif /* COMPRESS_H */
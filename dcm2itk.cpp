@@ -0,0 +1,214 @@
+#include "dcm2itk.h"
+#include "utils.h"
+#include <gdcmRescaler.h>
+#include <itkRGBPixel.h>
+#include <itkRGBAPixel.h>
+#include <cstdio>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+  DicomInput scan_archive(std::unique_ptr<ZipReaderPool> zip, unsigned n_threads)
+  {
+    DicomInput input;
+    input.name = zip->path();
+    input.entries = zip->acquire()->entries();
+    auto headers = scan_zip(*zip, input.entries, n_threads);
+    input.zip = std::move(zip);
+    input.n_files = headers.size();
+    input.series = group_series(std::move(headers));
+    return input;
+  }
+
+  template <typename ImageType>
+  SeriesImage decode(const DicomInput& input, const Series& series, const ReadOptions& options,
+    itk::ImageIOBase::IOComponentType componentType, unsigned components, double factor)
+  {
+    auto image = read_image<ImageType>(input, series, options.n_threads, options.map_files);
+    using PixelType = typename ImageType::PixelType;
+    const auto n_pixels = image->GetBufferedRegion().GetNumberOfPixels();
+    if constexpr (std::is_floating_point_v<PixelType>) {
+      if (factor != 1.0) {
+        scale_buffer(image->GetBufferPointer(), n_pixels, static_cast<PixelType>(factor));
+      }
+    }
+    SeriesImage result;
+    result.image = image.GetPointer();
+    result.component_type = componentType;
+    result.components = components;
+    result.buffer = image->GetBufferPointer();
+    result.bytes = uint64_t(n_pixels) * sizeof(PixelType);
+    return result;
+  }
+}
+
+bool DicomInput::read_slice(const SliceHeader& header, gdcm::ImageReader& reader) const
+{
+  if (zip) {
+    return read_zip_slice(*zip, entries, header, reader);
+  }
+  reader.SetFileName(header.filename.c_str());
+  return reader.Read();
+}
+
+uint64_t DicomInput::input_bytes(const Series& series) const
+{
+  uint64_t bytes = 0;
+  for (const auto& slice : series.slices) {
+    if (zip) {
+      bytes += entries[slice.entry].uncompressed_size;
+    }
+    else {
+      std::error_code ec;
+      auto size = fs::file_size(slice.filename, ec);
+      bytes += ec ? 0 : size;
+    }
+  }
+  return bytes;
+}
+
+std::string DicomInput::fingerprint(const Series& series) const
+{
+  std::ostringstream ss;
+  for (const auto& slice : series.slices) {
+    ss << slice.filename << '\t';
+    if (zip) {
+      const auto& entry = entries[slice.entry];
+      ss << entry.uncompressed_size << '\t' << entry.crc;
+    }
+    else {
+      std::error_code ec;
+      auto size = fs::file_size(slice.filename, ec);
+      auto mtime = ec ? fs::file_time_type() : fs::last_write_time(slice.filename, ec);
+      ss << (ec ? 0 : size) << '\t' << mtime.time_since_epoch().count();
+    }
+    ss << '\n';
+  }
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(fnv1a(ss.str())));
+  return std::to_string(series.slices.size()) + ":" + hex;
+}
+
+bool is_zip_input(const std::string& input)
+{
+  return fs::path(input).extension() == ".zip";
+}
+
+DicomInput scan_dicom(const std::string& path, unsigned n_threads, HeaderIndex* index)
+{
+  if (!fs::exists(path)) {
+    throw std::runtime_error("Could not find input(" + path + ").");
+  }
+  if (is_zip_input(path)) {
+    return scan_archive(std::make_unique<ZipReaderPool>(path), n_threads);
+  }
+  DicomInput input;
+  input.name = path;
+  auto headers = scan_directory(path, n_threads, index);
+  input.n_files = headers.size();
+  input.series = group_series(std::move(headers));
+  return input;
+}
+
+DicomInput scan_zip_buffer(const void* data, size_t size, unsigned n_threads)
+{
+  return scan_archive(std::make_unique<ZipReaderPool>(data, size), n_threads);
+}
+
+itk::ImageIOBase::IOComponentType component_type(const SliceHeader& header, double scale)
+{
+  // the range of the stored values decides the type, like GDCMImageIO: 12 bits stored with an intercept of -1024 fit in a short
+  auto allocated = static_cast<unsigned short>(header.bits_allocated);
+  auto stored = static_cast<unsigned short>(header.bits_stored > 0 && header.bits_stored <= header.bits_allocated ? header.bits_stored : header.bits_allocated);
+  auto high_bit = static_cast<unsigned short>(header.high_bit < allocated ? header.high_bit : stored - 1);
+  gdcm::PixelFormat pf(static_cast<unsigned short>(header.samples_per_pixel), allocated, stored, high_bit, static_cast<unsigned short>(header.pixel_representation));
+  gdcm::Rescaler r;
+  r.SetIntercept(header.intercept);
+  r.SetSlope(header.slope * scale);
+  r.SetPixelFormat(pf);
+  switch (r.ComputeInterceptSlopePixelType()) {
+  case gdcm::PixelFormat::UINT8:
+    return itk::ImageIOBase::UCHAR;
+  case gdcm::PixelFormat::INT8:
+    return itk::ImageIOBase::CHAR;
+  case gdcm::PixelFormat::UINT12:
+  case gdcm::PixelFormat::UINT16:
+    return itk::ImageIOBase::USHORT;
+  case gdcm::PixelFormat::INT12:
+  case gdcm::PixelFormat::INT16:
+    return itk::ImageIOBase::SHORT;
+  case gdcm::PixelFormat::UINT32:
+    return itk::ImageIOBase::UINT;
+  case gdcm::PixelFormat::INT32:
+    return itk::ImageIOBase::INT;
+  case gdcm::PixelFormat::FLOAT32:
+    return itk::ImageIOBase::FLOAT;
+  case gdcm::PixelFormat::FLOAT64:
+    return itk::ImageIOBase::DOUBLE;
+  default:
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  }
+}
+
+itk::ImageIOBase::IOComponentType output_component_type(const SliceHeader& first, itk::ImageIOBase::IOComponentType output_type)
+{
+  if (first.modality == "PT") {
+    return output_type == itk::ImageIOBase::DOUBLE ? itk::ImageIOBase::DOUBLE : itk::ImageIOBase::FLOAT;
+  }
+  if (output_type != itk::ImageIOBase::UNKNOWNCOMPONENTTYPE) {
+    return output_type;
+  }
+  return component_type(first);
+}
+
+SeriesImage read_series(const DicomInput& input, const Series& series, const ReadOptions& options)
+{
+  const auto& first = series.slices.front();
+  if (first.samples_per_pixel == 3 || first.samples_per_pixel == 4) {
+    auto componentType = component_type(first);
+    if (componentType != itk::ImageIOBase::UCHAR) {
+      throw std::runtime_error("Unsupported component type:" + itk::ImageIOBase::GetComponentTypeAsString(componentType));
+    }
+    if (first.samples_per_pixel == 4) {
+      return decode<itk::Image<itk::RGBAPixel<uint8_t>, 3>>(input, series, options, componentType, 4, 1.0);
+    }
+    return decode<itk::Image<itk::RGBPixel<uint8_t>, 3>>(input, series, options, componentType, 3, 1.0);
+  }
+  if (first.samples_per_pixel != 1) {
+    throw std::runtime_error("Invalid num of components:" + std::to_string(first.samples_per_pixel));
+  }
+  double factor = 1.0;
+  auto componentType = options.output_type != itk::ImageIOBase::UNKNOWNCOMPONENTTYPE ? options.output_type : component_type(first);
+  if (options.suv && first.modality == "PT") {
+    if (!first.suv_error.empty()) {
+      throw std::runtime_error(first.suv_error);
+    }
+    factor = calculate_bw_factor(first.suv, false);
+    componentType = output_component_type(first, options.output_type);
+  }
+  switch (componentType) {
+  case itk::ImageIOBase::UCHAR:
+    return decode<itk::Image<uint8_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::CHAR:
+    return decode<itk::Image<int8_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::USHORT:
+    return decode<itk::Image<uint16_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::SHORT:
+    return decode<itk::Image<int16_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::UINT:
+    return decode<itk::Image<uint32_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::INT:
+    return decode<itk::Image<int32_t, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::FLOAT:
+    return decode<itk::Image<float, 3>>(input, series, options, componentType, 1, factor);
+  case itk::ImageIOBase::DOUBLE:
+    return decode<itk::Image<double, 3>>(input, series, options, componentType, 1, factor);
+  default:
+    throw std::runtime_error("Unsupported component type:" + itk::ImageIOBase::GetComponentTypeAsString(componentType));
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef DCM2ITK_H
+#define DCM2ITK_H
+#include <itkImage.h>
+#include <itkImageIOBase.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "archive.h"
+#include "series.h"
+#include "volume.h"
+
+class HeaderIndex;
+
+/// <summary>
+/// DICOM series of a directory, a zip file or a zip archive in memory, grouped from the parsed headers.
+/// Pixel data is read on demand straight from the files or archive entries, without temporary files.
+/// </summary>
+struct DicomInput
+{
+  std::string name;                   // path of the input, "<memory>" for an archive in memory
+  std::vector<Series> series;
+  std::vector<ZipEntry> entries;      // archive only
+  std::unique_ptr<ZipReaderPool> zip; // archive only. Handles are shared by the readers of the archive
+  size_t n_files = 0;                 // DICOM images found, before series are filtered
+
+  bool is_archive() const { return zip != nullptr; }
+
+  /// <summary>
+  /// Read() the file or the archive entry of the slice. Thread safe.
+  /// </summary>
+  bool read_slice(const SliceHeader& header, gdcm::ImageReader& reader) const;
+
+  /// <summary>
+  /// Size of the files (uncompressed size of the entries) of the series
+  /// </summary>
+  uint64_t input_bytes(const Series& series) const;
+
+  /// <summary>
+  /// Hash of the files of the series: paths, sizes and modification times of files, or names, sizes and CRCs of entries.
+  /// </summary>
+  std::string fingerprint(const Series& series) const;
+};
+
+bool is_zip_input(const std::string& input);
+
+/// <summary>
+/// Parse the headers of a directory (recursively) or a .zip file on n_threads threads and group them into series.
+/// The index is used for directories only. std::runtime_error is thrown if the archive can't be opened.
+/// </summary>
+DicomInput scan_dicom(const std::string& path, unsigned n_threads = 0, HeaderIndex* index = nullptr);
+
+/// <summary>
+/// Parse the headers of a zip archive in memory. The data is not copied and must outlive the input.
+/// </summary>
+DicomInput scan_zip_buffer(const void* data, size_t size, unsigned n_threads = 0);
+
+/// <summary>
+/// Component type of the series after rescaling, as reported by itk::GDCMImageIO
+/// </summary>
+itk::ImageIOBase::IOComponentType component_type(const SliceHeader& header, double scale = 1.0);
+
+/// <summary>
+/// Component type of a grayscale series: output_type if given (UNKNOWNCOMPONENTTYPE keeps the type after rescaling).
+/// SUV images are float unless double is requested.
+/// </summary>
+itk::ImageIOBase::IOComponentType output_component_type(const SliceHeader& first, itk::ImageIOBase::IOComponentType output_type);
+
+/// <summary>
+/// Decode a series of the input into an image of ImageType (see read_volume).
+/// With map_files, uncompressed files of directories are copied from memory mapped files.
+/// </summary>
+template <typename ImageType>
+typename ImageType::Pointer read_image(const DicomInput& input, const Series& series, unsigned n_threads = 0, bool map_files = true)
+{
+  auto read_slice = [&input](const SliceHeader& h, gdcm::ImageReader& r) { return input.read_slice(h, r); };
+  return read_volume<ImageType>(series, read_slice, n_threads, map_files && !input.is_archive());
+}
+
+struct ReadOptions
+{
+  unsigned n_threads = 0;
+  bool map_files = true;
+  bool suv = true; // PET series in SUVbw (float or double)
+  itk::ImageIOBase::IOComponentType output_type = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE; // grayscale only
+};
+
+/// <summary>
+/// Decoded series. The image is an itk::Image<T, 3> of the component type for grayscale series,
+/// or of itk::RGBPixel<uint8_t> / itk::RGBAPixel<uint8_t> for color series.
+/// </summary>
+struct SeriesImage
+{
+  itk::ImageBase<3>::Pointer image;
+  itk::ImageIOBase::IOComponentType component_type = itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  unsigned components = 1;
+  void* buffer = nullptr; // pixel buffer of the image, x fastest
+  uint64_t bytes = 0;
+};
+
+/// <summary>
+/// Decode a series with the pixel type the command line tool writes it with.
+/// std::runtime_error is thrown for series which can't be decoded in memory (e.g. palette color, planar RGB)
+/// and for PET series without the SUV attributes.
+/// </summary>
+SeriesImage read_series(const DicomInput& input, const Series& series, const ReadOptions& options = {});
+
+#endif /* DCM2ITK_H */
@@ -0,0 +1,176 @@
+#include "dcm2itk_c.h"
+#include "dcm2itk.h"
+#include <exception>
+#include <string>
+
+struct dcm2itk_input
+{
+  DicomInput input;
+};
+
+namespace
+{
+  thread_local std::string last_error;
+
+  /// <summary>
+  /// Run fn and keep the message of any exception, which must not cross the C interface
+  /// </summary>
+  template <typename Fn>
+  bool guarded(Fn&& fn)
+  {
+    try {
+      fn();
+      return true;
+    }
+    catch (itk::ExceptionObject& ex) {
+      last_error = ex.GetDescription();
+    }
+    catch (std::exception& ex) {
+      last_error = ex.what();
+    }
+    catch (const char* ex) {
+      last_error = ex;
+    }
+    catch (...) {
+      last_error = "Unknown error";
+    }
+    return false;
+  }
+
+  const std::pair<itk::ImageIOBase::IOComponentType, int> component_types[] = {
+    { itk::ImageIOBase::UCHAR, DCM2ITK_UINT8 }, { itk::ImageIOBase::CHAR, DCM2ITK_INT8 },
+    { itk::ImageIOBase::USHORT, DCM2ITK_UINT16 }, { itk::ImageIOBase::SHORT, DCM2ITK_INT16 },
+    { itk::ImageIOBase::UINT, DCM2ITK_UINT32 }, { itk::ImageIOBase::INT, DCM2ITK_INT32 },
+    { itk::ImageIOBase::FLOAT, DCM2ITK_FLOAT32 }, { itk::ImageIOBase::DOUBLE, DCM2ITK_FLOAT64 } };
+
+  int to_c(itk::ImageIOBase::IOComponentType type)
+  {
+    for (const auto& t : component_types) {
+      if (t.first == type) {
+        return t.second;
+      }
+    }
+    return DCM2ITK_UNKNOWN;
+  }
+
+  itk::ImageIOBase::IOComponentType from_c(int type)
+  {
+    for (const auto& t : component_types) {
+      if (t.second == type) {
+        return t.first;
+      }
+    }
+    return itk::ImageIOBase::UNKNOWNCOMPONENTTYPE;
+  }
+
+  const Series* find_series(const dcm2itk_input* input, size_t index)
+  {
+    if (!input || index >= input->input.series.size()) {
+      last_error = "Invalid series index: " + std::to_string(index);
+      return nullptr;
+    }
+    return &input->input.series[index];
+  }
+}
+
+const char* dcm2itk_last_error(void)
+{
+  return last_error.c_str();
+}
+
+dcm2itk_input* dcm2itk_open(const char* path, unsigned n_threads)
+{
+  dcm2itk_input* input = nullptr;
+  guarded([&]() { input = new dcm2itk_input{ scan_dicom(path, n_threads) }; });
+  return input;
+}
+
+dcm2itk_input* dcm2itk_open_zip_buffer(const void* data, size_t size, unsigned n_threads)
+{
+  dcm2itk_input* input = nullptr;
+  guarded([&]() { input = new dcm2itk_input{ scan_zip_buffer(data, size, n_threads) }; });
+  return input;
+}
+
+void dcm2itk_close(dcm2itk_input* input)
+{
+  delete input;
+}
+
+size_t dcm2itk_series_count(const dcm2itk_input* input)
+{
+  return input ? input->input.series.size() : 0;
+}
+
+int dcm2itk_get_series_info(const dcm2itk_input* input, size_t index, dcm2itk_series_info* info)
+{
+  auto series = find_series(input, index);
+  if (!series) {
+    return -1;
+  }
+  if (!info) {
+    last_error = "info is NULL";
+    return -1;
+  }
+  const auto& first = series->slices.front();
+  info->identifier = series->identifier.c_str();
+  info->series_uid = first.series_uid.c_str();
+  info->modality = first.modality.c_str();
+  info->description = first.description.c_str();
+  info->series_number = first.series_number.c_str();
+  info->files = series->slices.size();
+  return 0;
+}
+
+void dcm2itk_default_read_options(dcm2itk_read_options* options)
+{
+  ReadOptions defaults;
+  options->n_threads = defaults.n_threads;
+  options->map_files = defaults.map_files;
+  options->suv = defaults.suv;
+  options->component_type = to_c(defaults.output_type);
+}
+
+dcm2itk_volume* dcm2itk_read_series(const dcm2itk_input* input, size_t index, const dcm2itk_read_options* options)
+{
+  auto series = find_series(input, index);
+  if (!series) {
+    return nullptr;
+  }
+  ReadOptions read_options;
+  if (options) {
+    read_options.n_threads = options->n_threads;
+    read_options.map_files = options->map_files != 0;
+    read_options.suv = options->suv != 0;
+    read_options.output_type = from_c(options->component_type);
+  }
+  dcm2itk_volume* volume = nullptr;
+  guarded([&]() {
+    auto result = read_series(input->input, *series, read_options);
+    const auto& image = *result.image;
+    volume = new dcm2itk_volume();
+    for (unsigned i = 0; i < 3; ++i) {
+      volume->size[i] = image.GetLargestPossibleRegion().GetSize()[i];
+      volume->spacing[i] = image.GetSpacing()[i];
+      volume->origin[i] = image.GetOrigin()[i];
+      for (unsigned j = 0; j < 3; ++j) {
+        volume->direction[3 * i + j] = image.GetDirection()[i][j];
+      }
+    }
+    volume->component_type = to_c(result.component_type);
+    volume->components = result.components;
+    volume->data = result.buffer;
+    volume->bytes = result.bytes;
+    // the reference keeps the image (and its buffer) alive until dcm2itk_free_volume
+    volume->image = new itk::ImageBase<3>::Pointer(result.image);
+  });
+  return volume;
+}
+
+void dcm2itk_free_volume(dcm2itk_volume* volume)
+{
+  if (volume) {
+    delete static_cast<itk::ImageBase<3>::Pointer*>(volume->image);
+    delete volume;
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef DCM2ITK_C_H
+#define DCM2ITK_C_H
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Functions are exported from the shared library dcm2itk_c, which is built with DCM2ITK_C_EXPORTS and hidden symbols.
+ * dllimport is not needed as only functions are exported, so the header is the same for the static libdcm2itk.
+ */
+#if defined(_WIN32)
+#ifdef DCM2ITK_C_EXPORTS
+#define DCM2ITK_API __declspec(dllexport)
+#else
+#define DCM2ITK_API
+#endif
+#elif defined(__GNUC__) || defined(__clang__)
+#define DCM2ITK_API __attribute__((visibility("default")))
+#else
+#define DCM2ITK_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C interface of libdcm2itk (see dcm2itk.h), e.g. for ctypes or cffi.
+ * Functions returning a pointer return NULL on failure and functions returning int return 0 on success;
+ * dcm2itk_last_error() then describes the failure.
+ */
+
+typedef struct dcm2itk_input dcm2itk_input;
+
+enum dcm2itk_component_type {
+  DCM2ITK_UNKNOWN = 0,
+  DCM2ITK_UINT8,
+  DCM2ITK_INT8,
+  DCM2ITK_UINT16,
+  DCM2ITK_INT16,
+  DCM2ITK_UINT32,
+  DCM2ITK_INT32,
+  DCM2ITK_FLOAT32,
+  DCM2ITK_FLOAT64
+};
+
+typedef struct dcm2itk_series_info {
+  const char* identifier; /* valid until the input is closed */
+  const char* series_uid;
+  const char* modality;
+  const char* description;
+  const char* series_number;
+  uint64_t files;
+} dcm2itk_series_info;
+
+typedef struct dcm2itk_read_options {
+  unsigned n_threads;  /* 0 uses all cores */
+  int map_files;       /* copy uncompressed pixel data of directories from memory mapped files */
+  int suv;             /* PET series in SUVbw */
+  int component_type;  /* dcm2itk_component_type of grayscale series, DCM2ITK_UNKNOWN keeps the type after rescaling */
+} dcm2itk_read_options;
+
+typedef struct dcm2itk_volume {
+  uint64_t size[3];     /* x, y, z */
+  double spacing[3];
+  double origin[3];
+  double direction[9];  /* row major, columns are the directions of the axes */
+  int component_type;   /* dcm2itk_component_type */
+  unsigned components;  /* 1, 3 (RGB) or 4 (RGBA) */
+  void* data;           /* x fastest, components interleaved */
+  uint64_t bytes;
+  void* image;          /* owned by the library */
+} dcm2itk_volume;
+
+/* Message of the last failure on the calling thread */
+DCM2ITK_API const char* dcm2itk_last_error(void);
+
+/* Scan a directory or a .zip file. Only headers are parsed. */
+DCM2ITK_API dcm2itk_input* dcm2itk_open(const char* path, unsigned n_threads);
+
+/* Scan a zip archive in memory. The data is not copied and must stay valid until the input is closed. */
+DCM2ITK_API dcm2itk_input* dcm2itk_open_zip_buffer(const void* data, size_t size, unsigned n_threads);
+
+DCM2ITK_API void dcm2itk_close(dcm2itk_input* input);
+
+DCM2ITK_API size_t dcm2itk_series_count(const dcm2itk_input* input);
+
+DCM2ITK_API int dcm2itk_get_series_info(const dcm2itk_input* input, size_t index, dcm2itk_series_info* info);
+
+/* Default options: all cores, memory mapped files and SUV */
+DCM2ITK_API void dcm2itk_default_read_options(dcm2itk_read_options* options);
+
+/* Decode a series into memory. options may be NULL for the defaults. Free the volume with dcm2itk_free_volume. */
+DCM2ITK_API dcm2itk_volume* dcm2itk_read_series(const dcm2itk_input* input, size_t index, const dcm2itk_read_options* options);
+
+DCM2ITK_API void dcm2itk_free_volume(dcm2itk_volume* volume);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DCM2ITK_C_H */
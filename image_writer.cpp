@@ -0,0 +1,268 @@
+#include "image_writer.h"
+#include "compress.h"
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace
+{
+  bool ends_with(const std::string& s, const std::string& suffix)
+  {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  /// same layout as nifti_1_header in nifti1.h
+  struct NiftiHeader {
+    int32_t sizeof_hdr;
+    char data_type[10];
+    char db_name[18];
+    int32_t extents;
+    int16_t session_error;
+    char regular;
+    char dim_info;
+    int16_t dim[8];
+    float intent_p1;
+    float intent_p2;
+    float intent_p3;
+    int16_t intent_code;
+    int16_t datatype;
+    int16_t bitpix;
+    int16_t slice_start;
+    float pixdim[8];
+    float vox_offset;
+    float scl_slope;
+    float scl_inter;
+    int16_t slice_end;
+    char slice_code;
+    char xyzt_units;
+    float cal_max;
+    float cal_min;
+    float slice_duration;
+    float toffset;
+    int32_t glmax;
+    int32_t glmin;
+    char descrip[80];
+    char aux_file[24];
+    int16_t qform_code;
+    int16_t sform_code;
+    float quatern_b;
+    float quatern_c;
+    float quatern_d;
+    float qoffset_x;
+    float qoffset_y;
+    float qoffset_z;
+    float srow_x[4];
+    float srow_y[4];
+    float srow_z[4];
+    char intent_name[16];
+    char magic[4];
+  };
+  static_assert(sizeof(NiftiHeader) == 348, "Unexpected size of the NIfTI-1 header");
+
+  /// <summary>
+  /// Rotation part of the qform in the same manner as nifti_mat44_to_quatern.
+  /// r is orthonormal with columns as axes.
+  /// </summary>
+  void to_quaternion(double r[3][3], NiftiHeader& hdr)
+  {
+    auto det = r[0][0] * (r[1][1] * r[2][2] - r[1][2] * r[2][1])
+      - r[0][1] * (r[1][0] * r[2][2] - r[1][2] * r[2][0])
+      + r[0][2] * (r[1][0] * r[2][1] - r[1][1] * r[2][0]);
+    hdr.pixdim[0] = 1.0f;
+    if (det < 0) {
+      hdr.pixdim[0] = -1.0f;
+      for (int i = 0; i < 3; ++i) {
+        r[i][2] = -r[i][2];
+      }
+    }
+    double a = r[0][0] + r[1][1] + r[2][2] + 1.0, b, c, d;
+    if (a > 0.5) {
+      a = 0.5 * std::sqrt(a);
+      b = 0.25 * (r[2][1] - r[1][2]) / a;
+      c = 0.25 * (r[0][2] - r[2][0]) / a;
+      d = 0.25 * (r[1][0] - r[0][1]) / a;
+    }
+    else {
+      auto xd = 1.0 + r[0][0] - (r[1][1] + r[2][2]);
+      auto yd = 1.0 + r[1][1] - (r[0][0] + r[2][2]);
+      auto zd = 1.0 + r[2][2] - (r[0][0] + r[1][1]);
+      if (xd > 1.0) {
+        b = 0.5 * std::sqrt(xd);
+        c = 0.25 * (r[0][1] + r[1][0]) / b;
+        d = 0.25 * (r[0][2] + r[2][0]) / b;
+        a = 0.25 * (r[2][1] - r[1][2]) / b;
+      }
+      else if (yd > 1.0) {
+        c = 0.5 * std::sqrt(yd);
+        b = 0.25 * (r[0][1] + r[1][0]) / c;
+        d = 0.25 * (r[1][2] + r[2][1]) / c;
+        a = 0.25 * (r[0][2] - r[2][0]) / c;
+      }
+      else {
+        d = 0.5 * std::sqrt(zd);
+        b = 0.25 * (r[0][2] + r[2][0]) / d;
+        c = 0.25 * (r[1][2] + r[2][1]) / d;
+        a = 0.25 * (r[1][0] - r[0][1]) / d;
+      }
+      if (a < 0.0) {
+        b = -b;
+        c = -c;
+        d = -d;
+      }
+    }
+    hdr.quatern_b = static_cast<float>(b);
+    hdr.quatern_c = static_cast<float>(c);
+    hdr.quatern_d = static_cast<float>(d);
+  }
+
+  /// <summary>
+  /// NIfTI-1 single file header. LPS is converted to RAS. sform holds the exact affine and
+  /// qform is omitted (qform_code 0) when the direction is not orthogonal (e.g. gantry tilt).
+  /// </summary>
+  NiftiHeader nifti_header(const ImageGeometry& g, const VoxelFormat& format)
+  {
+    NiftiHeader hdr;
+    std::memset(&hdr, 0, sizeof(hdr));
+    hdr.sizeof_hdr = 348;
+    hdr.regular = 'r';
+    hdr.dim[0] = 3;
+    for (int i = 0; i < 3; ++i) {
+      hdr.dim[i + 1] = static_cast<int16_t>(g.size[i]);
+      hdr.pixdim[i + 1] = static_cast<float>(g.spacing[i]);
+    }
+    for (int i = 4; i < 8; ++i) {
+      hdr.dim[i] = 1;
+      hdr.pixdim[i] = 1.0f;
+    }
+    hdr.datatype = format.nifti_datatype;
+    hdr.bitpix = format.bitpix;
+    hdr.vox_offset = 352.0f;
+    hdr.scl_slope = 1.0f;
+    hdr.xyzt_units = 2 | 8; // NIFTI_UNITS_MM | NIFTI_UNITS_SEC
+    std::strcpy(hdr.magic, "n+1");
+
+    // RAS = diag(-1, -1, 1) * LPS
+    const double flip[3] = { -1.0, -1.0, 1.0 };
+    double r[3][3];
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        r[i][j] = flip[i] * g.direction[i][j];
+      }
+    }
+    float* srow[3] = { hdr.srow_x, hdr.srow_y, hdr.srow_z };
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        srow[i][j] = static_cast<float>(r[i][j] * g.spacing[j]);
+      }
+      srow[i][3] = static_cast<float>(flip[i] * g.origin[i]);
+    }
+    hdr.sform_code = 1; // NIFTI_XFORM_SCANNER_ANAT
+    hdr.qoffset_x = hdr.srow_x[3];
+    hdr.qoffset_y = hdr.srow_y[3];
+    hdr.qoffset_z = hdr.srow_z[3];
+
+    bool orthogonal = true;
+    for (int j = 0; j < 3; ++j) {
+      for (int k = j + 1; k < 3; ++k) {
+        auto dot = r[0][j] * r[0][k] + r[1][j] * r[1][k] + r[2][j] * r[2][k];
+        orthogonal = orthogonal && std::abs(dot) < 1e-4;
+      }
+    }
+    if (orthogonal) {
+      to_quaternion(r, hdr);
+      hdr.qform_code = 1;
+    }
+    else {
+      hdr.pixdim[0] = 1.0f;
+    }
+    return hdr;
+  }
+
+  void write_nifti_gz(const std::string& filename, const ImageGeometry& g, const VoxelFormat& format, const void* buffer, size_t bytes, const CompressOptions& options)
+  {
+    for (auto s : g.size) {
+      if (s > 32767) {
+        throw std::runtime_error("Image is too large for NIfTI-1: " + filename);
+      }
+    }
+    auto hdr = nifti_header(g, format);
+    char header[352] = {};
+    std::memcpy(header, &hdr, sizeof(hdr)); // followed by an empty extension flag
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs) {
+      throw std::runtime_error("Could not open: " + filename);
+    }
+    parallel_deflate(ofs, { { header, sizeof(header) }, { static_cast<const char*>(buffer), bytes } }, DeflateWrapper::gzip, options.level, options.threads);
+  }
+
+  /// <summary>
+  /// MetaImage with the fields written by itk::MetaImageIO. CompressedDataSize is unknown until
+  /// the data is compressed, so space is reserved and the value is filled in afterwards.
+  /// </summary>
+  void write_mha(const std::string& filename, const ImageGeometry& g, const VoxelFormat& format, const void* buffer, size_t bytes, const CompressOptions& options)
+  {
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs) {
+      throw std::runtime_error("Could not open: " + filename);
+    }
+    const std::string size_field = "CompressedDataSize = ";
+    const size_t size_width = 20;
+    std::ostringstream header;
+    header << std::setprecision(15);
+    header << "ObjectType = Image\n";
+    header << "NDims = 3\n";
+    header << "BinaryData = True\n";
+    header << "BinaryDataByteOrderMSB = False\n";
+    header << "CompressedData = True\n";
+    auto size_pos = static_cast<std::streamoff>(header.str().size() + size_field.size());
+    header << size_field << std::string(size_width, ' ') << "\n";
+    header << "TransformMatrix =";
+    for (int j = 0; j < 3; ++j) { // column by column
+      for (int i = 0; i < 3; ++i) {
+        header << " " << g.direction[i][j];
+      }
+    }
+    header << "\n";
+    header << "Offset = " << g.origin[0] << " " << g.origin[1] << " " << g.origin[2] << "\n";
+    header << "CenterOfRotation = 0 0 0\n";
+    header << "ElementSpacing = " << g.spacing[0] << " " << g.spacing[1] << " " << g.spacing[2] << "\n";
+    header << "DimSize = " << g.size[0] << " " << g.size[1] << " " << g.size[2] << "\n";
+    if (format.components > 1) {
+      header << "ElementNumberOfChannels = " << format.components << "\n";
+    }
+    header << "ElementType = " << format.met_element_type << "\n";
+    header << "ElementDataFile = LOCAL\n";
+    auto text = header.str();
+    ofs.write(text.data(), text.size());
+
+    auto compressed_size = parallel_deflate(ofs, { { static_cast<const char*>(buffer), bytes } }, DeflateWrapper::zlib, options.level, options.threads);
+    auto value = std::to_string(compressed_size);
+    ofs.seekp(size_pos);
+    ofs.write(value.data(), value.size());
+    if (!ofs) {
+      throw std::runtime_error("Could not write: " + filename);
+    }
+  }
+}
+
+bool is_parallel_compressible(const std::string& filename, bool compress)
+{
+  return ends_with(filename, ".nii.gz") || (compress && ends_with(filename, ".mha"));
+}
+
+void write_compressed(const std::string& filename, const ImageGeometry& geometry, const VoxelFormat& format, const void* buffer, const CompressOptions& options)
+{
+  const size_t bytes = geometry.size[0] * geometry.size[1] * geometry.size[2] * (format.bitpix / 8);
+  if (ends_with(filename, ".nii.gz")) {
+    write_nifti_gz(filename, geometry, format, buffer, bytes, options);
+  }
+  else if (ends_with(filename, ".mha")) {
+    write_mha(filename, geometry, format, buffer, bytes, options);
+  }
+  else {
+    throw std::runtime_error("Unsupported format for parallel compression: " + filename);
+  }
+}
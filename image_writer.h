@@ -0,0 +1,96 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+#include <cstdint>
+#include <string>
+#include <itkImage.h>
+#include <itkRGBPixel.h>
+#include <itkRGBAPixel.h>
+
+struct VoxelFormat {
+  int16_t nifti_datatype;
+  int16_t bitpix;
+  const char* met_element_type;
+  unsigned components;
+};
+
+template <typename T>
+struct VoxelTraits {
+  static constexpr bool supported = false;
+};
+#define DCM2ITK_VOXEL_TRAITS(T, datatype, bitpix, met, components) \
+  template <> \
+  struct VoxelTraits<T> { \
+    static constexpr bool supported = true; \
+    static constexpr VoxelFormat format = { datatype, bitpix, met, components }; \
+  };
+DCM2ITK_VOXEL_TRAITS(uint8_t, 2, 8, "MET_UCHAR", 1)
+DCM2ITK_VOXEL_TRAITS(int8_t, 256, 8, "MET_CHAR", 1)
+DCM2ITK_VOXEL_TRAITS(uint16_t, 512, 16, "MET_USHORT", 1)
+DCM2ITK_VOXEL_TRAITS(int16_t, 4, 16, "MET_SHORT", 1)
+DCM2ITK_VOXEL_TRAITS(uint32_t, 768, 32, "MET_UINT", 1)
+DCM2ITK_VOXEL_TRAITS(int32_t, 8, 32, "MET_INT", 1)
+DCM2ITK_VOXEL_TRAITS(float, 16, 32, "MET_FLOAT", 1)
+DCM2ITK_VOXEL_TRAITS(double, 64, 64, "MET_DOUBLE", 1)
+DCM2ITK_VOXEL_TRAITS(itk::RGBPixel<uint8_t>, 128, 24, "MET_UCHAR", 3)
+DCM2ITK_VOXEL_TRAITS(itk::RGBAPixel<uint8_t>, 2304, 32, "MET_UCHAR", 4)
+#undef DCM2ITK_VOXEL_TRAITS
+
+/// <summary>
+/// Geometry in ITK (LPS) convention. direction[row][column] as itk::Image::GetDirection().
+/// </summary>
+struct ImageGeometry {
+  size_t size[3];
+  double spacing[3];
+  double origin[3];
+  double direction[3][3];
+};
+
+struct CompressOptions {
+  int level = 6;        // zlib level
+  unsigned threads = 0; // 0 uses all cores
+};
+
+/// <summary>
+/// Whether write_compressed handles the file: .nii.gz always, .mha when compress is set
+/// (in the same manner as itk::ImageFileWriter::SetUseCompression).
+/// </summary>
+bool is_parallel_compressible(const std::string& filename, bool compress);
+
+/// <summary>
+/// Write header and voxels with the compressed stream deflated on multiple threads.
+/// The files are standard gzip (.nii.gz) / zlib (MetaImage CompressedData) streams readable by ITK.
+/// std::runtime_error is thrown on failure.
+/// </summary>
+void write_compressed(const std::string& filename, const ImageGeometry& geometry, const VoxelFormat& format, const void* buffer, const CompressOptions& options);
+
+/// <summary>
+/// Write the image with write_compressed if the format and pixel type are supported.
+/// </summary>
+/// <returns>false if the caller has to write the image (e.g. with itk::ImageFileWriter)</returns>
+template <typename ImageType>
+bool write_compressed(const ImageType* image, const std::string& filename, bool compress, const CompressOptions& options)
+{
+  using Pixel = typename ImageType::PixelType;
+  if constexpr (ImageType::ImageDimension == 3 && VoxelTraits<Pixel>::supported) {
+    if (!is_parallel_compressible(filename, compress)) {
+      return false;
+    }
+    ImageGeometry geometry;
+    const auto& size = image->GetBufferedRegion().GetSize();
+    for (unsigned i = 0; i < 3; ++i) {
+      geometry.size[i] = size[i];
+      geometry.spacing[i] = image->GetSpacing()[i];
+      geometry.origin[i] = image->GetOrigin()[i];
+      for (unsigned j = 0; j < 3; ++j) {
+        geometry.direction[i][j] = image->GetDirection()[i][j];
+      }
+    }
+    write_compressed(filename, geometry, VoxelTraits<Pixel>::format, image->GetBufferPointer(), options);
+    return true;
+  }
+  else {
+    return false;
+  }
+}
+
+#endif /* IMAGE_WRITER_H */
@@ -0,0 +1,211 @@
+#include "index_cache.h"
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+  // bump when the fields of SliceHeader change
+  const std::string index_magic = "dcm2itk-index\t3";
+
+  std::string key(const std::string& path)
+  {
+    return fs::absolute(fs::path(path)).lexically_normal().string();
+  }
+
+  std::string escape(const std::string& s)
+  {
+    std::string out;
+    out.reserve(s.size());
+    for (auto c : s) {
+      switch (c) {
+      case '\\': out += "\\\\"; break;
+      case '\t': out += "\\t"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      default: out += c;
+      }
+    }
+    return out;
+  }
+
+  std::string unescape(const std::string& s)
+  {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+      if (s[i] == '\\' && i + 1 < s.size()) {
+        switch (s[++i]) {
+        case 't': out += '\t'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        default: out += s[i];
+        }
+      }
+      else {
+        out += s[i];
+      }
+    }
+    return out;
+  }
+
+  /// <summary>
+  /// Tab separated fields of a line
+  /// </summary>
+  class Record
+  {
+  public:
+    Record()
+    {
+      ss << std::setprecision(std::numeric_limits<double>::max_digits10);
+    }
+    explicit Record(const std::string& line)
+    {
+      size_t begin = 0;
+      while (true) { // empty fields are kept unlike std::getline
+        auto end = line.find('\t', begin);
+        fields.push_back(unescape(line.substr(begin, end - begin)));
+        if (end == std::string::npos) {
+          break;
+        }
+        begin = end + 1;
+      }
+    }
+    template <typename T>
+    Record& operator<<(const T& value)
+    {
+      if (!first) {
+        ss << '\t';
+      }
+      first = false;
+      if constexpr (std::is_same_v<T, std::string>) {
+        ss << escape(value);
+      }
+      else {
+        ss << value;
+      }
+      return *this;
+    }
+    template <typename T>
+    Record& operator>>(T& value)
+    {
+      if (pos >= fields.size()) {
+        throw std::runtime_error("Too few fields");
+      }
+      const auto& field = fields[pos++];
+      if constexpr (std::is_same_v<T, std::string>) {
+        value = field;
+      }
+      else {
+        std::stringstream is(field);
+        if (!(is >> value)) {
+          throw std::runtime_error("Invalid field: " + field);
+        }
+      }
+      return *this;
+    }
+    std::string str() const { return ss.str(); }
+  private:
+    std::stringstream ss;
+    bool first = true;
+    std::vector<std::string> fields;
+    size_t pos = 0;
+  };
+
+  template <typename RecordOp, typename Header>
+  void fields(RecordOp&& op, Header& h)
+  {
+    op(h.series_uid); op(h.series_identifier); op(h.modality); op(h.description); op(h.series_number); op(h.series_date); op(h.image_type);
+    op(h.instance_number); op(h.has_instance_number);
+    op(h.has_position);
+    for (auto& v : h.position) op(v);
+    for (auto& v : h.orientation) op(v);
+    op(h.rows); op(h.columns); op(h.frames); op(h.samples_per_pixel); op(h.photometric); op(h.bits_allocated); op(h.bits_stored); op(h.high_bit); op(h.pixel_representation);
+    op(h.planar_configuration); op(h.transfer_syntax);
+    op(h.slope); op(h.intercept);
+    op(h.suv.weight); op(h.suv.dose); op(h.suv.halflife); op(h.suv.pharma_starttime); op(h.suv.seriesdate); op(h.suv.seriestime);
+    op(h.suv_error);
+  }
+}
+
+HeaderIndex::HeaderIndex(const std::string& filename)
+  : filename(filename)
+{
+  std::ifstream ifs(filename, std::ios::binary);
+  std::string line;
+  if (!ifs || !std::getline(ifs, line) || line != index_magic) {
+    return;
+  }
+  while (std::getline(ifs, line)) {
+    try {
+      Record r(line);
+      std::string path;
+      IndexedFile file;
+      r >> path >> file.size >> file.mtime >> file.is_dicom;
+      if (file.is_dicom) {
+        fields([&r](auto& v) { r >> v; }, file.header);
+      }
+      files[path] = std::move(file);
+    }
+    catch (std::exception&) {
+      // a broken line only costs a re-parse of the file
+    }
+  }
+}
+
+const IndexedFile* HeaderIndex::find(const std::string& path, uint64_t size, int64_t mtime)
+{
+  auto it = files.find(key(path));
+  if (it == files.end() || it->second.size != size || it->second.mtime != mtime) {
+    return nullptr;
+  }
+  ++hits;
+  return &it->second;
+}
+
+void HeaderIndex::update(const std::string& dirname, std::vector<std::pair<std::string, IndexedFile>> scanned)
+{
+  auto prefix = (fs::path(key(dirname)) / "").string();
+  for (auto it = files.begin(); it != files.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0) {
+      it = files.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+  for (auto& s : scanned) {
+    files[key(s.first)] = std::move(s.second);
+  }
+}
+
+void HeaderIndex::save() const
+{
+  auto temp = filename + ".tmp";
+  {
+    std::ofstream ofs(temp, std::ios::binary);
+    ofs << index_magic << '\n';
+    for (const auto& f : files) {
+      Record r;
+      r << f.first << f.second.size << f.second.mtime << f.second.is_dicom;
+      if (f.second.is_dicom) {
+        fields([&r](auto& v) { r << v; }, f.second.header);
+      }
+      ofs << r.str() << '\n';
+    }
+    if (!ofs) {
+      throw std::runtime_error("Could not write index: " + temp);
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, filename, ec);
+  if (ec) {
+    throw std::runtime_error("Could not write index: " + filename + " (" + ec.message() + ")");
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef INDEX_CACHE_H
+#define INDEX_CACHE_H
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "series.h"
+
+struct IndexedFile {
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  bool is_dicom = false; // non-DICOM files are indexed too so that they are not parsed again
+  SliceHeader header;
+};
+
+/// <summary>
+/// On-disk cache of parsed headers keyed by absolute path. An entry is reused only while
+/// the size and the modification time of the file are unchanged.
+/// </summary>
+class HeaderIndex
+{
+public:
+  /// <summary>
+  /// Load the index. A missing file or a file written by another version gives an empty index.
+  /// </summary>
+  explicit HeaderIndex(const std::string& filename);
+
+  /// <returns>nullptr if the file is not indexed or has been changed</returns>
+  const IndexedFile* find(const std::string& path, uint64_t size, int64_t mtime);
+
+  /// <summary>
+  /// Replace the entries under dirname with the files found by the latest scan.
+  /// Entries of other directories are kept.
+  /// </summary>
+  void update(const std::string& dirname, std::vector<std::pair<std::string, IndexedFile>> scanned);
+
+  /// <summary>
+  /// Write the index to a temporary file and rename it so that an interrupted run does not leave a broken index.
+  /// std::runtime_error is thrown on failure.
+  /// </summary>
+  void save() const;
+
+  /// <summary>
+  /// Number of entries returned by find()
+  /// </summary>
+  size_t reused() const { return hits; }
+
+private:
+  std::string filename;
+  size_t hits = 0;
+  std::unordered_map<std::string, IndexedFile> files;
+};
+
+#endif /* INDEX_CACHE_H */
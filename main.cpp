@@ -1,22 +1,40 @@
 #include "itkImage.h"
 #include "itkGDCMImageIO.h"
-#include "itkGDCMSeriesFileNames.h"
-#include <itkImageIOFactory.h>
 #include "itkImageSeriesReader.h"
 #include "itkImageFileWriter.h"
-#include <gdcmReader.h>
-#include <gdcmWriter.h>
+#include "itkUnaryFunctorImageFilter.h"
 #include <mz.h>
-#include <mz_strm.h>
-#include <mz_strm_os.h>
-#include <mz_zip.h>
-#include <mz_zip_rw.h>
 #include <filesystem>
+#include <fstream>
 #include <tclap/CmdLine.h>
 #include <config.h>
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <csignal>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
 #include <thread>
+#include <type_traits>
 #include "utils.h"
+#include "archive.h"
+#include "series.h"
+#include "volume.h"
+#include "thread_pool.h"
+#include "image_writer.h"
+#include "index_cache.h"
+#include "stats.h"
+#include "watch.h"
+#include "dcm2itk.h"
+#include "manifest.h"
+
+struct FailedWrites;
 
 struct Args {
   std::string input;
@@ -25,6 +43,27 @@ struct Args {
   std::string tmpdir;
   std::string ext;
   bool compress;
+  CompressOptions compress_options;
+  unsigned jobs;
+  uint64_t ram_budget; // bytes, 0 for unlimited
+  uint64_t max_memory; // bytes, series larger than this are streamed in slabs. 0 for unlimited
+  std::string reader; // itk, parallel or compare
+  unsigned decode_threads;
+  bool map_files; // copy uncompressed pixel data from memory mapped files
+  itk::ImageIOBase::IOComponentType output_type; // UNKNOWNCOMPONENTTYPE keeps the component type of the series
+  Stats* stats = nullptr; // nullptr unless --stats or --stats-json
+  ThreadPool* write_stage = nullptr; // writes decoded images in the background when set
+  FailedWrites* failed_writes = nullptr; // outputs whose background write failed, set with write_stage
+  std::string index; // header index file, empty if not used
+  SeriesFilter filter; // series to convert
+  OutputManifest* manifest = nullptr; // outputs of the output directory, nullptr with --no-manifest or --shard
+  bool force = false; // convert series recorded as unchanged again
+  bool use_manifest = true;
+  unsigned shard = 0;    // --shard shard/n_shards
+  unsigned n_shards = 1;
+  std::ostream* shard_manifest = nullptr; // series of this shard and their outputs, --shard only
+  bool probe = false; // print the inventory of the series instead of converting them
+  bool pipeline; // overlap writing a series with reading the next one when series are converted one by one
 };
 
 namespace fs = std::filesystem;
@@ -33,39 +72,12 @@ using std::cerr;
 using std::endl;
 
 
-class ZipReader
-{
-public:
-  void* zip_reader;
-  void* file_stream;
-  int32_t err;
-  ZipReader(const char* path)
-    : zip_reader(NULL), file_stream(NULL)
-  {
-    mz_zip_reader_create(&zip_reader);
-    mz_stream_os_create(&file_stream);
-
-    err = mz_stream_os_open(file_stream, path, MZ_OPEN_MODE_READ);
-    if (err == MZ_OK) {
-      err = mz_zip_reader_open(zip_reader, file_stream);
-    }
-  }
-
-  ~ZipReader()
-  {
-    mz_zip_reader_close(zip_reader);
-    mz_stream_os_close(file_stream);
-    mz_stream_os_delete(&file_stream);
-    mz_zip_reader_delete(&zip_reader);
-  }
-};
-
-fs::path get_available_name(const fs::path& dir, const std::string& stem, const std::string& ext)
+fs::path get_available_name(const fs::path& dir, const std::string& stem, const std::string& ext, const std::set<std::string>& reserved = {}, bool check_existing = true)
 {
   for (int i = 0; i < 10000; ++i) {
     {
       auto temp_dir = dir / (stem + "_(" + std::to_string(i) + ")" + ext);
-      if (!fs::exists(temp_dir)) {
+      if (!(check_existing && fs::exists(temp_dir)) && reserved.count(temp_dir.string()) == 0) {
         return temp_dir;
       }
     }
@@ -100,49 +112,385 @@ public:
       return New();
     }
     else {
-      return TempDir(get_available_name(tmpdir, "tmpzip", ""));
+      auto tid = std::this_thread::get_id();
+      std::stringstream ss;
+      ss << tid;
+      return TempDir(get_available_name(tmpdir, ss.str() + "tmpzip", ""));
     }
   }
 };
 using FileNamesContainer = std::vector<std::string>;
 
+/// <summary>
+/// Read a series from files with itk::ImageSeriesReader
+/// </summary>
+struct ItkSeriesReader
+{
+  const FileNamesContainer& fileNames;
+
+  template <typename ImageType>
+  typename ImageType::Pointer read() const
+  {
+    using ReaderType = itk::ImageSeriesReader<ImageType>;
+    typename ReaderType::Pointer reader = ReaderType::New();
+    using ImageIOType = itk::GDCMImageIO;
+    ImageIOType::Pointer dicomIO = ImageIOType::New();
+    reader->SetImageIO(dicomIO);
+    reader->SetFileNames(fileNames);
+    reader->ForceOrthogonalDirectionOff(); // properly read CTs with gantry tilt
+    reader->Update();
+    typename ImageType::Pointer image = reader->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+  }
+};
+
+/// <summary>
+/// Multiply by factor and convert to TOut. Integer outputs saturate in the same manner as rescale_copy.
+/// </summary>
+template <typename TOut>
+struct ScaleConvert
+{
+  double factor = 1.0;
+
+  TOut operator()(double v) const
+  {
+    if constexpr (std::is_floating_point_v<TOut>) {
+      return static_cast<TOut>(v * factor);
+    }
+    else {
+      return saturate<TOut>(v * factor);
+    }
+  }
+  bool operator==(const ScaleConvert& other) const { return factor == other.factor; }
+  bool operator!=(const ScaleConvert& other) const { return !(*this == other); }
+};
+
+/// <summary>
+/// Whether the format can be written slab by slab by itk::ImageFileWriter: uncompressed MetaImage, NRRD and NIfTI
+/// </summary>
+bool is_streamable(const std::string& filename, bool compress)
+{
+  auto ext = fs::path(filename).extension().string();
+  return ext == ".nii" || (!compress && (ext == ".mha" || ext == ".mhd" || ext == ".nrrd" || ext == ".nhdr"));
+}
+
+/// <summary>
+/// Number of z-slabs needed to convert the series within max_memory. 1 if the whole image fits.
+/// While streaming, a slab is held as read (double for grayscale) and as converted.
+/// </summary>
 template <typename ImageType>
-void _read_n_write(const FileNamesContainer& fileNames, const std::string outFileName, bool compress = true)
-{
-  //  auto imageio = itk::ImageIOFactory::CreateImageIO(fileNames.front().c_str(), itk::ImageIOFactory::FileModeType::ReadMode);
-  auto imageio = itk::GDCMImageIO::New();
-  imageio->LoadPrivateTagsDefaultOn();
-  imageio->LoadPrivateTagsOn();
-  imageio->SetFileName(fileNames.front());
-  imageio->ReadImageInformation();
-
-  auto& meta = imageio->GetMetaDataDictionary();
-
-  using ReaderType = itk::ImageSeriesReader<ImageType>;
-  typename ReaderType::Pointer reader = ReaderType::New();
-  using ImageIOType = itk::GDCMImageIO;
-  ImageIOType::Pointer dicomIO = ImageIOType::New();
-  reader->SetImageIO(dicomIO);
-  reader->SetFileNames(fileNames);
-  reader->ForceOrthogonalDirectionOff(); // properly read CTs with gantry tilt
+unsigned stream_divisions(const Series& series, uint64_t max_memory)
+{
+  using Pixel = typename ImageType::PixelType;
+  constexpr bool is_scalar = std::is_arithmetic_v<Pixel>;
+  const auto& first = series.slices.front();
+  const uint64_t plane_pixels = uint64_t(first.rows) * first.columns;
+  const uint64_t planes = uint64_t(first.frames) * series.slices.size();
+  if (max_memory == 0 || 2 * plane_pixels * planes * sizeof(Pixel) <= max_memory) {
+    return 1;
+  }
+  if (first.frames != 1) {
+    throw std::runtime_error("Multi-frame images can't be read in slabs: " + series.identifier);
+  }
+  const uint64_t plane_bytes = plane_pixels * (sizeof(Pixel) + (is_scalar ? sizeof(double) : sizeof(Pixel)));
+  const auto slab_planes = std::max<uint64_t>(1, max_memory / plane_bytes);
+  return static_cast<unsigned>((planes + slab_planes - 1) / slab_planes);
+}
+
+/// <summary>
+/// Convert files to outFileName in z-slabs. Only the slices of the slab being written are read.
+/// Grayscale images are read as double and converted by ScaleConvert so that values are rescaled and
+/// clamped as the in-memory readers do.
+/// </summary>
+template <typename ImageType>
+void stream_files(const FileNamesContainer& fileNames, const std::string& outFileName, unsigned divisions, double factor)
+{
+  using Pixel = typename ImageType::PixelType;
   using WriterType = itk::ImageFileWriter<ImageType>;
-  typename WriterType::Pointer writer = WriterType::New();
+  auto writer = WriterType::New();
   writer->SetFileName(outFileName);
-  writer->SetUseCompression(compress);
-  writer->SetInput(reader->GetOutput());
-  cout << "Writing: " << outFileName << endl;
+  writer->SetUseCompression(false);
+  writer->SetNumberOfStreamDivisions(divisions);
+  auto read = [&fileNames](auto reader) {
+    reader->SetImageIO(itk::GDCMImageIO::New());
+    reader->SetFileNames(fileNames);
+    reader->ForceOrthogonalDirectionOff(); // properly read CTs with gantry tilt
+    return reader;
+  };
+  if constexpr (std::is_arithmetic_v<Pixel>) {
+    using InputImageType = itk::Image<double, ImageType::ImageDimension>;
+    auto reader = read(itk::ImageSeriesReader<InputImageType>::New());
+    using FilterType = itk::UnaryFunctorImageFilter<InputImageType, ImageType, ScaleConvert<Pixel>>;
+    auto filter = FilterType::New();
+    ScaleConvert<Pixel> functor;
+    functor.factor = factor;
+    filter->SetFunctor(functor);
+    filter->SetInput(reader->GetOutput());
+    writer->SetInput(filter->GetOutput());
+    writer->Update();
+  }
+  else {
+    auto reader = read(itk::ImageSeriesReader<ImageType>::New());
+    writer->SetInput(reader->GetOutput());
+    writer->Update();
+  }
+}
+
+/// <summary>
+/// Read a series from files decoding slices in parallel.
+/// Falls back to itk::ImageSeriesReader for series which can't be decoded by read_volume.
+/// With args.reader == "compare", both readers are run and their timings and outputs are reported.
+/// </summary>
+struct FileSeriesReader
+{
+  const DicomInput& input;
+  const Series& series;
+  const Args& args;
+
+  FileNamesContainer fileNames() const
+  {
+    FileNamesContainer names;
+    for (const auto& slice : series.slices) {
+      names.push_back(slice.filename);
+    }
+    return names;
+  }
+
+  uint64_t input_bytes() const { return input.input_bytes(series); }
+
+  template <typename ImageType>
+  typename ImageType::Pointer read_parallel() const
+  {
+    return read_image<ImageType>(input, series, args.decode_threads, args.map_files);
+  }
+
+  template <typename ImageType>
+  typename ImageType::Pointer read() const
+  {
+    if constexpr (ImageType::ImageDimension == 3) {
+      if (args.reader == "compare") {
+        return compare<ImageType>();
+      }
+      if (args.reader != "itk") {
+        try {
+          return read_parallel<ImageType>();
+        }
+        catch (std::runtime_error& ex) {
+          cerr << ex.what() << endl;
+          cout << "Fall back to ImageSeriesReader" << endl;
+        }
+      }
+    }
+    return ItkSeriesReader{ fileNames() }.template read<ImageType>();
+  }
+
+  template <typename ImageType>
+  void stream(const std::string& outFileName, unsigned divisions, double factor = 1.0) const
+  {
+    stream_files<ImageType>(fileNames(), outFileName, divisions, factor);
+  }
+
+  template <typename ImageType>
+  typename ImageType::Pointer compare() const
+  {
+    using clock = std::chrono::steady_clock;
+    auto t0 = clock::now();
+    auto itk_image = ItkSeriesReader{ fileNames() }.template read<ImageType>();
+    auto t1 = clock::now();
+    typename ImageType::Pointer image;
+    try {
+      image = read_parallel<ImageType>();
+    }
+    catch (std::runtime_error& ex) {
+      cout << "parallel reader: not supported (" << ex.what() << ")" << endl;
+      return itk_image;
+    }
+    auto t2 = clock::now();
+    cout << "itk reader: " << std::chrono::duration<double>(t1 - t0).count() << " s" << endl;
+    cout << "parallel reader: " << std::chrono::duration<double>(t2 - t1).count() << " s" << endl;
+
+    bool same_geometry = image->GetLargestPossibleRegion() == itk_image->GetLargestPossibleRegion();
+    for (unsigned i = 0; i < 3 && same_geometry; ++i) {
+      same_geometry = std::abs(image->GetOrigin()[i] - itk_image->GetOrigin()[i]) < 1e-4
+        && std::abs(image->GetSpacing()[i] - itk_image->GetSpacing()[i]) < 1e-4;
+      for (unsigned j = 0; j < 3; ++j) {
+        same_geometry = same_geometry && std::abs(image->GetDirection()[i][j] - itk_image->GetDirection()[i][j]) < 1e-4;
+      }
+    }
+    if (!same_geometry) {
+      cout << "geometry: different" << endl;
+      return image;
+    }
+    size_t n_pixels = image->GetLargestPossibleRegion().GetNumberOfPixels();
+    size_t n_different = 0;
+    const auto a = image->GetBufferPointer();
+    const auto b = itk_image->GetBufferPointer();
+    for (size_t i = 0; i < n_pixels; ++i) {
+      if (std::memcmp(a + i, b + i, sizeof(typename ImageType::PixelType)) != 0) {
+        n_different++;
+      }
+    }
+    cout << "geometry: same" << endl;
+    cout << "different pixels: " << n_different << "/" << n_pixels << endl;
+    return image;
+  }
+};
+
+/// <summary>
+/// Multiply the image read by another reader with a factor, e.g. SUVbwScaleFactor.
+/// Only floating point images are scaled.
+/// </summary>
+template <typename SeriesReader>
+struct ScaledSeriesReader
+{
+  const SeriesReader& seriesReader;
+  const Series& series;
+  double factor;
+  Stats* stats;
+
+  uint64_t input_bytes() const { return seriesReader.input_bytes(); }
+
+  template <typename ImageType>
+  void stream(const std::string& outFileName, unsigned divisions, double factor = 1.0) const
+  {
+    // only floating point images are scaled as read() does
+    const bool scale = std::is_floating_point_v<typename ImageType::PixelType>;
+    seriesReader.template stream<ImageType>(outFileName, divisions, scale ? factor * this->factor : factor);
+  }
+
+  template <typename ImageType>
+  typename ImageType::Pointer read() const
+  {
+    auto image = seriesReader.template read<ImageType>();
+    using PixelType = typename ImageType::PixelType;
+    if constexpr (std::is_floating_point_v<PixelType>) {
+      if (factor != 1.0) {
+        StageTimer timer(stats, "suv");
+        timer.items = image->GetBufferedRegion().GetSize()[2];
+        scale_buffer(image->GetBufferPointer(), image->GetBufferedRegion().GetNumberOfPixels(), static_cast<PixelType>(factor));
+      }
+    }
+    return image;
+  }
+};
+
+/// <summary>
+/// Outputs whose write on the write stage failed. The series are reported as failed once the write stage is drained.
+/// </summary>
+struct FailedWrites
+{
+  std::mutex mutex;
+  std::set<std::string> outputs;
+
+  void add(const std::string& output)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    outputs.insert(output);
+  }
+  bool contains(const std::string& output)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return outputs.count(output) > 0;
+  }
+};
+
+/// <summary>
+/// Write a decoded image and record it in the manifest. Errors are reported and not thrown since this may run on the write stage.
+/// </summary>
+/// <returns>false if the image could not be written</returns>
+template <typename ImageType>
+bool write_image(const typename ImageType::Pointer& image, const std::string& outFileName, bool compress, const CompressOptions& options, Stats* stats, OutputManifest* manifest)
+{
   try
   {
-    writer->Update();
+    cout << "Writing: " << outFileName << endl;
+    StageTimer timer(stats, "write");
+    timer.items = 1;
+    if (!write_compressed(image.GetPointer(), outFileName, compress, options)) {
+      using WriterType = itk::ImageFileWriter<ImageType>;
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetFileName(outFileName);
+      writer->SetUseCompression(compress);
+      writer->SetInput(image);
+      writer->Update();
+    }
+    std::error_code ec;
+    auto size = fs::file_size(outFileName, ec);
+    timer.bytes = ec ? 0 : size;
+    if (manifest) {
+      manifest->written(outFileName);
+    }
+    return true;
+  }
+  catch (itk::ExceptionObject& ex)
+  {
+    cerr << ex << endl;
+  }
+  catch (std::exception& ex)
+  {
+    cerr << ex.what() << endl;
+  }
+  return false;
+}
+
+/// <summary>
+/// Read a series and write it. With the write stage, only failures of reading are returned and
+/// failures of writing are added to args.failed_writes.
+/// </summary>
+template <typename ImageType, typename SeriesReader>
+int _read_n_write(const SeriesReader& seriesReader, const std::string outFileName, const Args& args, bool compress = true)
+{
+  try
+  {
+    auto divisions = stream_divisions<ImageType>(seriesReader.series, args.max_memory);
+    if (divisions > 1) {
+      if (!is_streamable(outFileName, args.compress)) {
+        throw std::runtime_error("The series does not fit in --max-memory and " + outFileName
+          + " can't be written in slabs. Use .nii, .nrrd or .mha without --compress.");
+      }
+      cout << "Writing in " << divisions << " slabs: " << outFileName << endl;
+      StageTimer timer(args.stats, "stream");
+      seriesReader.template stream<ImageType>(outFileName, divisions);
+      timer.bytes = seriesReader.input_bytes();
+      timer.items = seriesReader.series.slices.size();
+      if (args.manifest) {
+        args.manifest->written(outFileName);
+      }
+      return EXIT_SUCCESS;
+    }
+    typename ImageType::Pointer image;
+    {
+      StageTimer timer(args.stats, "decode");
+      image = seriesReader.template read<ImageType>();
+      timer.bytes = seriesReader.input_bytes();
+      timer.items = image->GetLargestPossibleRegion().GetSize()[2];
+    }
+    if (args.write_stage) {
+      // the next series is read while this one is compressed and written
+      args.write_stage->submit([image, outFileName, compress, options = args.compress_options, stats = args.stats,
+        manifest = args.manifest, failed_writes = args.failed_writes]() {
+        if (!write_image<ImageType>(image, outFileName, compress, options, stats, manifest) && failed_writes) {
+          failed_writes->add(outFileName);
+        }
+      });
+      return EXIT_SUCCESS;
+    }
+    return write_image<ImageType>(image, outFileName, compress, args.compress_options, args.stats, args.manifest) ? EXIT_SUCCESS : EXIT_FAILURE;
   }
   catch (itk::ExceptionObject& ex)
   {
     cerr << ex << endl;
   }
+  catch (std::exception& ex)
+  {
+    cerr << ex.what() << endl;
+  }
+  return EXIT_FAILURE;
 }
 
-template <int Dimension>
-int read_n_write_color(const FileNamesContainer& fileNames, const std::string outFileName, itk::ImageIOBase::IOComponentType componentType, bool compress, bool is_rgba)
+template <int Dimension, typename SeriesReader>
+int read_n_write_color(const SeriesReader& seriesReader, const std::string outFileName, itk::ImageIOBase::IOComponentType componentType, const Args& args, bool is_rgba)
 {
   constexpr int dim = Dimension;
   if (componentType != itk::ImageIOBase::UCHAR) {
@@ -150,48 +498,39 @@ int read_n_write_color(const FileNamesContainer& fileNames, const std::string ou
     return 1;
   }
   if (is_rgba) {
-    _read_n_write<itk::Image<itk::RGBAPixel<uint8_t>, dim>>(fileNames, outFileName);
+    return _read_n_write<itk::Image<itk::RGBAPixel<uint8_t>, dim>>(seriesReader, outFileName, args);
   }
-  else {
-    _read_n_write<itk::Image<itk::RGBPixel<uint8_t>, dim>>(fileNames, outFileName);
-  }
-  return 0;
+  return _read_n_write<itk::Image<itk::RGBPixel<uint8_t>, dim>>(seriesReader, outFileName, args);
 }
 
-template <int Dimension>
-int read_n_write(const FileNamesContainer& fileNames, const std::string outFileName, itk::ImageIOBase::IOComponentType componentType, bool compress)
+template <int Dimension, typename SeriesReader>
+int read_n_write(const SeriesReader& seriesReader, const std::string outFileName, itk::ImageIOBase::IOComponentType componentType, const Args& args)
 {
-  /// UINT8 -> UINT8, SHORT -> SHORT, INT -> SHORT, FLOAT -> FLOAT, DOUBLE -> FLOAT
+  /// Every component type is written as is. Floating point images are compressed only when forced.
   constexpr int dim = Dimension;
   switch (componentType) {
   case itk::ImageIOBase::UCHAR:
-    _read_n_write<itk::Image<uint8_t, dim>>(fileNames, outFileName);
-    return 0;
+    return _read_n_write<itk::Image<uint8_t, dim>>(seriesReader, outFileName, args);
+  case itk::ImageIOBase::CHAR:
+    return _read_n_write<itk::Image<int8_t, dim>>(seriesReader, outFileName, args);
+  case itk::ImageIOBase::USHORT:
+    return _read_n_write<itk::Image<uint16_t, dim>>(seriesReader, outFileName, args);
   case itk::ImageIOBase::SHORT:
+    return _read_n_write<itk::Image<int16_t, dim>>(seriesReader, outFileName, args);
+  case itk::ImageIOBase::UINT:
+    return _read_n_write<itk::Image<uint32_t, dim>>(seriesReader, outFileName, args);
   case itk::ImageIOBase::INT:
-    _read_n_write<itk::Image<int16_t, dim>>(fileNames, outFileName);
-    return 0;
+    return _read_n_write<itk::Image<int32_t, dim>>(seriesReader, outFileName, args);
   case itk::ImageIOBase::FLOAT:
+    return _read_n_write<itk::Image<float, dim>>(seriesReader, outFileName, args, args.compress);
   case itk::ImageIOBase::DOUBLE:
-    _read_n_write<itk::Image<float, dim>>(fileNames, outFileName, compress | false);
-    return 0;
+    return _read_n_write<itk::Image<double, dim>>(seriesReader, outFileName, args, args.compress);
   default:
     cerr << "Unsupported component type:" << itk::ImageIOBase::GetComponentTypeAsString(componentType) << endl;
     return 1;
   }
 }
 
-template <typename ValueType = std::string>
-const ValueType& get_value(const itk::MetaDataDictionary& meta, const std::string& key)
-{
-  auto ptr = dynamic_cast<const itk::MetaDataObject<ValueType>*>(meta.Get(key));
-  return ptr->GetMetaDataObjectValue();
-}
-bool has_value(const itk::MetaDataDictionary& meta, const std::string& key)
-{
-  return meta.HasKey(key) && get_value(meta, key) != "";
-}
-
 bool ends_with(const std::string& s, const std::string& suffix) {
   if (s.size() < suffix.size()) return false;
   return std::equal(std::rbegin(suffix), std::rend(suffix), std::rbegin(s));
@@ -214,188 +553,738 @@ void to_valid_filename(std::string& filename)
 std::string rstrip(const std::string s)
 {
   auto end_it = s.rbegin();
-  while (std::isspace(*end_it))
+  while (end_it != s.rend() && std::isspace(*end_it))
     ++end_it;
   return std::string(s.begin(), end_it.base());
 }
 
-int dir_input(const Args& args)
+/// <summary>
+/// Name of the output of a series in args.outdir, without extension
+/// </summary>
+std::string output_stem(const std::string& seriesIdentifier, const std::string& description, const std::string& series_number)
 {
-  std::string dirName = args.input;
+  std::string stem(seriesIdentifier);
+  if (description != "") {
+    stem = description;
+  }
+  else if (series_number != "") {
+    stem = series_number;
+  }
+  to_valid_filename(stem);
+  return rstrip(stem);
+}
 
-  using NamesGeneratorType = itk::GDCMSeriesFileNames;
-  NamesGeneratorType::Pointer nameGenerator = NamesGeneratorType::New();
+/// <summary>
+/// Whether output_filename could name the output of the series filename in args.outdir: stem + ext or stem_(i) + ext
+/// </summary>
+bool is_output_name(const Args& args, const std::string& filename, const std::string& stem)
+{
+  const auto dir = fs::path(args.outdir);
+  if (filename == (dir / (stem + args.ext)).string()) {
+    return true;
+  }
+  const auto prefix = (dir / (stem + "_(")).string();
+  const auto suffix = ")" + args.ext;
+  if (filename.size() <= prefix.size() + suffix.size() || filename.compare(0, prefix.size(), prefix) != 0 || !ends_with(filename, suffix)) {
+    return false;
+  }
+  auto number = filename.substr(prefix.size(), filename.size() - prefix.size() - suffix.size());
+  return std::all_of(number.begin(), number.end(), [](char c) { return c >= '0' && c <= '9'; });
+}
 
-  nameGenerator->SetUseSeriesDetails(true);
-  nameGenerator->SetRecursive(true);
-  nameGenerator->AddSeriesRestriction("0008|0021");
-  nameGenerator->SetGlobalWarningDisplay(false);
-  nameGenerator->SetDirectory(dirName);
+/// <summary>
+/// Output filename of the series_count-th series.
+/// Names handed out earlier in the same run are kept in reserved so that series converted concurrently never share a name.
+/// With --shard, existing files are not looked at, so that every shard (and a single process writing to an empty directory)
+/// names the series alike while the other shards are writing.
+/// </summary>
+std::string output_filename(const Args& args, int series_count, const std::string& seriesIdentifier, const std::string& description, const std::string& series_number, std::set<std::string>& reserved)
+{
+  const bool check_existing = args.n_shards == 1;
+  if (args.output != "")
+  {
+    if (series_count == 1) {
+      reserved.insert(args.output);
+      return args.output;
+    }
+    fs::path output_path(args.output);
+    auto stem = output_path.stem().string();
+    auto ext = output_path.extension().string();
+    if (ends_with(args.output, ".nii.gz")) {
+      ext = ".nii.gz";
+      stem = std::string(args.output.c_str(), args.output.size() - 7);
+    }
+    auto outFileName = (output_path.parent_path() / (stem + "_(" + std::to_string(series_count) + ")" + ext)).string();
+    reserved.insert(outFileName);
+    return outFileName;
+  }
+  auto stem = output_stem(seriesIdentifier, description, series_number);
+  auto outFileName = (fs::path(args.outdir) / (stem + args.ext)).string();
+  if ((check_existing && fs::exists(outFileName)) || reserved.count(outFileName) > 0) {
+    outFileName = get_available_name(fs::path(args.outdir), stem, args.ext, reserved, check_existing).string();
+  }
+  reserved.insert(outFileName);
+  return outFileName;
+}
 
-  try
+struct ConversionTask
+{
+  uint64_t bytes; // estimated peak memory
+  std::function<int()> run;
+};
+
+/// <summary>
+/// Estimated peak memory to convert a series: the image read in memory and the buffer of the writer
+/// </summary>
+uint64_t estimate_bytes(uint64_t n_components, itk::ImageIOBase::IOComponentType componentType)
+{
+  switch (componentType) {
+  case itk::ImageIOBase::UCHAR:
+  case itk::ImageIOBase::CHAR:
+    return 2 * n_components;
+  case itk::ImageIOBase::USHORT:
+  case itk::ImageIOBase::SHORT:
+    return 2 * n_components * sizeof(int16_t);
+  case itk::ImageIOBase::UINT:
+  case itk::ImageIOBase::INT:
+  case itk::ImageIOBase::FLOAT:
+    return 2 * n_components * sizeof(float);
+  case itk::ImageIOBase::DOUBLE:
+    return 2 * n_components * sizeof(double);
+  default:
+    return 0;
+  }
+}
+
+/// <summary>
+/// Worker pool, write stage, memory budget and output manifests shared by all inputs of the process
+/// </summary>
+struct Workers
+{
+  std::unique_ptr<ThreadPool> pool; // nullptr when series are converted one by one
+  MemoryBudget budget;
+  std::map<std::string, std::unique_ptr<OutputManifest>> manifests; // by file, as inputs of a batch may share an output directory
+  std::unique_ptr<FailedWrites> failed_writes; // of the write stage
+  std::unique_ptr<ThreadPool> write_stage; // series converted one by one only. Destroyed first so that pending writes finish
+
+  explicit Workers(const Args& args)
+    : budget(args.ram_budget)
+  {
+    if (args.jobs != 1) {
+      pool = std::make_unique<ThreadPool>(args.jobs);
+    }
+    else if (args.pipeline && args.ram_budget == 0 && args.max_memory == 0) {
+      // one image waiting and one being written, so that at most three images are in memory with the one being read.
+      // Not with a memory limit, which counts the image being read only
+      write_stage = std::make_unique<ThreadPool>(1, 1);
+      failed_writes = std::make_unique<FailedWrites>();
+    }
+  }
+
+  /// <summary>
+  /// args with the write stage of the workers
+  /// </summary>
+  Args attach(Args args) const
   {
-    using SeriesIdContainer = std::vector<std::string>;
-    const SeriesIdContainer& seriesUID = nameGenerator->GetSeriesUIDs();
-    auto seriesItr = seriesUID.begin();
-    auto seriesEnd = seriesUID.end();
+    args.write_stage = write_stage.get();
+    args.failed_writes = failed_writes.get();
+    return args;
+  }
 
-    if (seriesItr != seriesEnd)
-    {
-      cout << "The directory: ";
-      cout << dirName << endl;
-      cout << "Contains the following DICOM Series: ";
-      cout << endl;
+  /// <summary>
+  /// Manifest of the output directory, loaded once per process
+  /// </summary>
+  OutputManifest& manifest(const std::string& filename)
+  {
+    auto& manifest = manifests[filename];
+    if (!manifest) {
+      manifest = std::make_unique<OutputManifest>(filename);
     }
-    else
-    {
-      cout << "No DICOMs in: " << dirName << endl;
-      return EXIT_SUCCESS;
+    return *manifest;
+  }
+};
+
+/// <summary>
+/// Run a task. Exceptions are reported as a failure of the task.
+/// </summary>
+int run_task(const ConversionTask& task)
+{
+  try {
+    return task.run();
+  }
+  catch (itk::ExceptionObject& ex) {
+    cerr << ex << endl;
+  }
+  catch (std::exception& ex) {
+    cerr << ex.what() << endl;
+  }
+  return EXIT_FAILURE;
+}
+
+/// <summary>
+/// Run every conversion, in order. With more than one job, tasks are dispatched on the worker pool and
+/// each task reserves its estimated memory from the budget before it starts.
+/// A failed task doesn't stop the others; EXIT_FAILURE is returned if any of them failed.
+/// </summary>
+int run_conversions(Workers& workers, const std::vector<ConversionTask>& tasks)
+{
+  if (!workers.pool) {
+    int ret = EXIT_SUCCESS;
+    for (const auto& task : tasks) {
+      if (run_task(task) != EXIT_SUCCESS) {
+        ret = EXIT_FAILURE;
+      }
     }
+    return ret;
+  }
+  std::atomic<bool> failed(false);
+  auto& budget = workers.budget;
+  auto& pool = *workers.pool;
+  for (const auto& task : tasks) {
+    pool.submit([&]() {
+      auto reserved = budget.acquire(task.bytes);
+      int ret = run_task(task);
+      budget.release(reserved);
+      if (ret != EXIT_SUCCESS) {
+        failed = true;
+      }
+    });
+  }
+  pool.wait();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-    while (seriesItr != seriesEnd)
-    {
-      cout << seriesItr->c_str() << endl;
-      ++seriesItr;
+/// <summary>
+/// Write a series with the pixel type selected from its header
+/// </summary>
+template <typename SeriesReader>
+int write_series(const Args& args, const Series& series, const SeriesReader& seriesReader, const std::string& outFileName)
+{
+  cout << "Reading: " << series.identifier << endl;
+  const auto& first = series.slices.front();
+  if (first.modality == "PT") {
+    cout << "Convert to SUV" << endl;
+    if (!first.suv_error.empty()) {
+      cerr << first.suv_error << endl;
+      return EXIT_FAILURE;
+    }
+    // SUVbwScaleFactor is computed once per series from the header and applied to the decoded voxels as floating point.
+    // Input files are never modified.
+    auto factor = calculate_bw_factor(first.suv, false);
+    auto componentType = output_component_type(first, args.output_type);
+    if (args.output_type != itk::ImageIOBase::UNKNOWNCOMPONENTTYPE && args.output_type != componentType) {
+      cout << "Warning: SUV images are written as " << itk::ImageIOBase::GetComponentTypeAsString(componentType) << endl;
     }
+    return read_n_write<3>(ScaledSeriesReader<SeriesReader>{ seriesReader, series, factor, args.stats }, outFileName, componentType, args);
+  }
+  switch (first.samples_per_pixel) {
+  case 1:
+    if (first.photometric == "PALETTE COLOR") {
+      return read_n_write_color<3>(seriesReader, outFileName, first.bits_allocated == 8 ? itk::ImageIOBase::UCHAR : itk::ImageIOBase::USHORT, args, false);
+    }
+    return read_n_write<3>(seriesReader, outFileName, output_component_type(first, args.output_type), args);
+  case 3:
+  case 4:
+    // --output-type applies to grayscale images only
+    return read_n_write_color<3>(seriesReader, outFileName, component_type(first), args, first.samples_per_pixel == 4);
+  default:
+    cerr << "Invalid num of components:" << first.samples_per_pixel << endl;
+    return 1;
+  }
+}
 
-    seriesItr = seriesUID.begin();
-    int series_count = 0;
-    while (seriesItr != seriesUID.end())
-    {
-      std::string seriesIdentifier = seriesItr->c_str();
-      seriesItr++;
-      series_count++;
-      cout << "Reading: " << seriesIdentifier << endl;
-      FileNamesContainer fileNames = nameGenerator->GetFileNames(seriesIdentifier);
-
-      auto imageio = itk::ImageIOFactory::CreateImageIO(fileNames.front().c_str(), itk::ImageIOFactory::FileModeType::ReadMode);
-      imageio->SetFileName(fileNames.front());
-      imageio->ReadImageInformation();
-      auto& meta = imageio->GetMetaDataDictionary();
-      auto modality = get_value(meta, "0008|0060");
-      if (modality == "PT") {
-        cout << "Convert to SUV" << endl;
-        for (auto& filename : fileNames) {
-          gdcm::Reader reader;
-          reader.SetFileName(filename.c_str());
-          if (!reader.Read())
-          {
-            cerr << "Could not read: " << filename << std::endl;
-            return EXIT_FAILURE;
-          }
-          auto& dcm = reader.GetFile();
-          auto modality = get_string(dcm.GetDataSet(), tags::modality);
-          if (modality != "PT") {
-            cerr << "Not a PET image." << endl;
-            return EXIT_FAILURE;
-          }
-          auto SUVbwScaleFactor = calculate_bw_factor(dcm, false);
-          rescale_slope(dcm, SUVbwScaleFactor);
-          gdcm::Writer writer;
-          writer.CheckFileMetaInformationOff();
-          writer.SetFileName(filename.c_str());
-          writer.SetFile(dcm);
-          if (!writer.Write()) {
-            cerr << "Could not write: " << filename << std::endl;
-            return EXIT_FAILURE;
-          };
-        }
+/// <summary>
+/// Options the content of an output depends on. Series recorded with other options are converted again.
+/// </summary>
+std::string conversion_options(const Args& args)
+{
+  std::ostringstream ss;
+  ss << "ext=" << args.ext << " compress=" << args.compress << " level=" << args.compress_options.level
+    << " type=" << itk::ImageIOBase::GetComponentTypeAsString(args.output_type) << " output=" << args.output;
+  return ss.str();
+}
+
+/// <summary>
+/// Print the series and convert them with convert(series, outFileName).
+/// With a manifest, series whose files and options are unchanged since their output was written are skipped,
+/// and changed series are written over their previous output.
+/// </summary>
+int convert_all(const Args& args, Workers& workers, const DicomInput& input, const std::function<int(const Series&, const std::string&)>& convert)
+{
+  const auto& series = input.series;
+  if (series.empty()) {
+    cout << "No DICOM series to convert in: " << args.input << endl;
+    return EXIT_SUCCESS;
+  }
+  cout << "The " << (fs::is_directory(args.input) ? "directory" : "archive") << ": ";
+  cout << args.input << endl;
+  cout << "Contains the following DICOM Series: ";
+  cout << endl;
+  for (const auto& s : series) {
+    cout << s.identifier << endl;
+  }
+
+  // recorded outputs are named first so that other series don't take their names
+  std::set<std::string> reserved;
+  std::vector<std::string> outFileNames(series.size());
+  std::vector<std::string> fingerprints(series.size());
+  std::vector<bool> unchanged(series.size(), false);
+  const auto options = conversion_options(args);
+  if (args.manifest) {
+    for (size_t i = 0; i < series.size(); ++i) {
+      fingerprints[i] = input.fingerprint(series[i]);
+      ManifestRecord record;
+      // the recorded output is reused only under a name this run would give the series
+      const auto& first = series[i].slices.front();
+      if (args.manifest->find(args.input, series[i].identifier, record) && record.options == options && fs::exists(record.output)
+        && is_output_name(args, record.output, output_stem(series[i].identifier, first.description, first.series_number))) {
+        outFileNames[i] = record.output;
+        reserved.insert(record.output);
+        unchanged[i] = !args.force && record.fingerprint == fingerprints[i];
       }
+    }
+  }
 
-      std::string outFileName;
-      if (args.output != "")
-      {
-        if (series_count == 1) {
-          outFileName = args.output;
-        }
-        else {
-          fs::path output_path(args.output);
-          auto stem = output_path.stem().string();
-          auto ext = output_path.extension().string();
-          if (ends_with(args.output, ".nii.gz")) {
-            ext = ".nii.gz";
-            stem = std::string(args.output.c_str(), args.output.size() - 7);
-          }
-          outFileName = (output_path.parent_path() / (stem + "_(" + std::to_string(series_count) + ")" + ext)).string();
-        }
+  // names and estimates are computed for every series so that they don't depend on the shard
+  int series_count = 0;
+  std::vector<std::string> keys;
+  std::vector<uint64_t> estimates;
+  for (size_t i = 0; i < series.size(); ++i) {
+    const auto& s = series[i];
+    series_count++;
+    const auto& first = s.slices.front();
+    if (outFileNames[i].empty()) {
+      outFileNames[i] = output_filename(args, series_count, s.identifier, first.description, first.series_number, reserved);
+    }
+    auto componentType = first.samples_per_pixel == 1 ? output_component_type(first, args.output_type) : component_type(first);
+    uint64_t n_components = uint64_t(first.rows) * first.columns * first.frames * first.samples_per_pixel * s.slices.size();
+    keys.push_back(s.identifier);
+    estimates.push_back(estimate_bytes(n_components, componentType));
+  }
+  auto shards = assign_shards(keys, estimates, args.n_shards);
+  if (args.n_shards > 1) {
+    cout << "Shard " << args.shard << "/" << args.n_shards << ": "
+      << std::count(shards.begin(), shards.end(), args.shard) << " of " << series.size() << " series" << endl;
+  }
+
+  std::vector<int> results(series.size(), EXIT_FAILURE);
+  std::vector<ConversionTask> tasks;
+  for (size_t i = 0; i < series.size(); ++i) {
+    if (shards[i] != args.shard) {
+      continue;
+    }
+    if (unchanged[i]) {
+      cout << "Unchanged: " << series[i].identifier << " (" << outFileNames[i] << ")" << endl;
+      results[i] = EXIT_SUCCESS;
+      continue;
+    }
+    if (args.manifest) {
+      args.manifest->expect(series[i].identifier, { fingerprints[i], options, args.input, outFileNames[i] });
+    }
+    auto bytes = estimates[i];
+    if (args.max_memory > 0) { // larger series are streamed
+      bytes = std::min(bytes, args.max_memory);
+    }
+    tasks.push_back({ bytes, [&convert, &s = series[i], &outFileName = outFileNames[i], &result = results[i]]() {
+      return result = convert(s, outFileName); // EXIT_FAILURE is kept if convert throws
+    } });
+  }
+  auto ret = run_conversions(workers, tasks);
+  if (args.write_stage) {
+    // the results of the series are known once their writes have finished
+    args.write_stage->wait();
+    for (size_t i = 0; i < series.size(); ++i) {
+      if (results[i] == EXIT_SUCCESS && args.failed_writes->contains(outFileNames[i])) {
+        results[i] = EXIT_FAILURE;
+        ret = EXIT_FAILURE;
       }
-      else
-      {
-        std::string stem(seriesIdentifier);
-        if (has_value(meta, "0008|103e")) { // series description
-          stem = get_value(meta, "0008|103e");
-        }
-        else if (has_value(meta, "0020|0011")) { // series number
-          stem = get_value(meta, "0020|0011");
-        }
-        to_valid_filename(stem);
-        stem = rstrip(stem);
-        outFileName = (fs::path(args.outdir) / (stem + args.ext)).string();
-        if (fs::exists(outFileName)) {
-          outFileName = get_available_name(fs::path(args.outdir), stem, args.ext).string();
-        }
+    }
+  }
+  if (args.shard_manifest) {
+    auto field = [](std::string v) {
+      std::replace_if(v.begin(), v.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+      return v;
+    };
+    auto& os = *args.shard_manifest;
+    for (size_t i = 0; i < series.size(); ++i) {
+      if (shards[i] == args.shard) {
+        const auto& first = series[i].slices.front();
+        os << field(args.input) << '\t' << field(first.series_uid) << '\t' << field(series[i].identifier) << '\t' << estimates[i] << '\t'
+          << field(outFileNames[i]) << '\t' << (results[i] == EXIT_SUCCESS ? "ok" : "failed") << '\n';
       }
+    }
+    os.flush();
+  }
+  return ret;
+}
+
+/// <summary>
+/// Read a series directly from the archive without temporary files.
+/// Series which can't be decoded in memory are extracted to a temporary directory and read with itk::ImageSeriesReader.
+/// </summary>
+struct ZipSeriesReader
+{
+  const DicomInput& input;
+  const Series& series;
+  const Args& args;
+
+  uint64_t input_bytes() const { return input.input_bytes(series); }
 
-      auto dimension = imageio->GetNumberOfDimensions();
-      auto componentType = imageio->GetComponentType();
-      auto pixelType = imageio->GetPixelType();
-      auto numberOfComponents = imageio->GetNumberOfComponents();
-      if (dimension != 2 && dimension != 3) {
-        cerr << "Invalid image dimension:" << dimension;
-        return 1;
+  template <typename ImageType>
+  typename ImageType::Pointer read() const
+  {
+    try {
+      return read_image<ImageType>(input, series, args.decode_threads);
+    }
+    catch (std::runtime_error& ex) {
+      cerr << ex.what() << endl;
+      cout << "Extract: " << series.identifier << endl;
+    }
+    auto temp_dir = TempDir::New(args.tmpdir);
+    return ItkSeriesReader{ extract(temp_dir.path) }.template read<ImageType>();
+  }
+
+  /// <summary>
+  /// Files are extracted to a temporary directory since itk::ImageSeriesReader reads slices from disk.
+  /// </summary>
+  template <typename ImageType>
+  void stream(const std::string& outFileName, unsigned divisions, double factor = 1.0) const
+  {
+    cout << "Extract: " << series.identifier << endl;
+    auto temp_dir = TempDir::New(args.tmpdir);
+    stream_files<ImageType>(extract(temp_dir.path), outFileName, divisions, factor);
+  }
+
+  /// <summary>
+  /// Entries are inflated and written on args.decode_threads threads
+  /// </summary>
+  FileNamesContainer extract(const fs::path& dir) const
+  {
+    FileNamesContainer fileNames(series.slices.size());
+    parallel_for(series.slices.size(), args.decode_threads, [&](size_t i) {
+      const auto& slice = series.slices[i];
+      std::vector<char> buffer;
+      if (input.zip->acquire()->read(input.entries[slice.entry], buffer) != MZ_OK) {
+        throw std::runtime_error("Could not extract: " + slice.filename);
       }
-      if (numberOfComponents != 1 && numberOfComponents != 3 && numberOfComponents != 4) {
-        cerr << "Invalid num of components:" << numberOfComponents << endl;
+      auto filename = (dir / std::to_string(i)).string();
+      std::ofstream ofs(filename, std::ios::binary);
+      ofs.write(buffer.data(), buffer.size());
+      if (!ofs) {
+        throw std::runtime_error("Could not write: " + filename);
       }
+      fileNames[i] = filename;
+    });
+    return fileNames;
+  }
+};
 
-      using IOBase = itk::ImageIOBase;
-      if (pixelType == IOBase::RGB || pixelType == IOBase::RGBA) {
-        switch (dimension) {
-        case 2:
-          read_n_write_color<2>(fileNames, outFileName, componentType, args.compress, pixelType==IOBase::RGBA);
-          break;
-        case 3:
-          read_n_write_color<3>(fileNames, outFileName, componentType, args.compress, pixelType==IOBase::RGBA);
-          break;
-        }
-        continue;
-      }
-      if (pixelType != IOBase::SCALAR) {
-        cerr << "Invalid pixel type:" << IOBase::GetPixelTypeAsString(pixelType) << endl;
-        return 1;
+/// <summary>
+/// Apply --modality, --series-uid, --min-slices, --description and --exclude-localizers.
+/// Slices of excluded series are never read, nor their entries inflated beyond the header scan.
+/// </summary>
+std::vector<Series> select_series(const Args& args, std::vector<Series> series)
+{
+  std::vector<std::string> excluded;
+  series = filter_series(std::move(series), args.filter, excluded);
+  if (!excluded.empty()) {
+    auto& os = args.probe ? cerr : cout;
+    os << "Excluded " << excluded.size() << " series:" << endl;
+    for (const auto& e : excluded) {
+      os << "  " << e << endl;
+    }
+  }
+  return series;
+}
+
+DicomInput scan_input(const Args& args, HeaderIndex* index)
+{
+  StageTimer timer(args.stats, "scan");
+  // Every header is parsed once here. The parsed headers are shared by grouping, naming, pixel type selection and the readers.
+  auto scanned = scan_dicom(args.input, args.decode_threads, index);
+  timer.items = scanned.n_files;
+  if (index && !scanned.is_archive()) {
+    (args.probe ? cerr : cout) << "Index: " << index->reused() << " files unchanged" << endl; // stdout is kept for the inventory
+    try {
+      index->save();
+    }
+    catch (std::runtime_error& ex) {
+      cerr << ex.what() << endl;
+    }
+  }
+  scanned.series = select_series(args, std::move(scanned.series));
+  return scanned;
+}
+
+int convert_input(const Args& input_args, Workers& workers, const DicomInput& scanned)
+{
+  auto args = input_args;
+  if (args.use_manifest && args.n_shards == 1 && args.output.empty()) {
+    // next to the outputs. Outputs named on the command line are always written
+    args.manifest = &workers.manifest((fs::path(args.outdir) / ".dcm2itk-manifest").string());
+  }
+  if (!scanned.is_archive()) {
+    return convert_all(args, workers, scanned, [&args, &scanned](const Series& s, const std::string& outFileName) {
+      return write_series(args, s, FileSeriesReader{ scanned, s, args }, outFileName);
+    });
+  }
+  return convert_all(args, workers, scanned, [&args, &scanned](const Series& s, const std::string& outFileName) {
+    return write_series(args, s, ZipSeriesReader{ scanned, s, args }, outFileName);
+  });
+}
+
+std::unique_ptr<HeaderIndex> open_index(const Args& args)
+{
+  if (args.index.empty()) {
+    return nullptr;
+  }
+  return std::make_unique<HeaderIndex>(args.index);
+}
+
+int single_input(const Args& args)
+{
+  Workers workers(args);
+  auto index = open_index(args);
+  return convert_input(workers.attach(args), workers, scan_input(args, index.get()));
+}
+
+/// <summary>
+/// Read inputs from a list file ("-" for stdin). Empty lines and lines starting with '#' are skipped.
+/// </summary>
+std::vector<std::string> read_input_list(const std::string& list)
+{
+  std::ifstream ifs;
+  if (list != "-") {
+    ifs.open(list);
+    if (!ifs) {
+      throw std::runtime_error("Could not open: " + list);
+    }
+  }
+  std::istream& is = list == "-" ? std::cin : ifs;
+  std::vector<std::string> inputs;
+  std::string line;
+  while (std::getline(is, line)) {
+    line = rstrip(line);
+    auto begin = line.find_first_not_of(" \t");
+    if (begin == std::string::npos || line[begin] == '#') {
+      continue;
+    }
+    inputs.push_back(line.substr(begin));
+  }
+  return inputs;
+}
+
+/// <summary>
+/// Write the series of a scanned input as a JSON object. Only the parsed headers are used.
+/// estimated_memory_bytes is the estimate used for --ram-budget, and output names are those a conversion would use now.
+/// </summary>
+void write_inventory(std::ostream& os, const Args& args, const DicomInput& scanned, const std::string& indent)
+{
+  os << indent << "{\n";
+  os << indent << "  \"input\": " << json_string(args.input) << ",\n";
+  os << indent << "  \"series\": [";
+  int series_count = 0;
+  std::set<std::string> reserved;
+  for (const auto& s : scanned.series) {
+    series_count++;
+    const auto& first = s.slices.front();
+    auto componentType = first.samples_per_pixel == 1 ? output_component_type(first, args.output_type) : component_type(first);
+    uint64_t n_components = uint64_t(first.rows) * first.columns * first.frames * first.samples_per_pixel * s.slices.size();
+    auto peak = estimate_bytes(n_components, componentType);
+    auto outFileName = output_filename(args, series_count, s.identifier, first.description, first.series_number, reserved);
+    const std::string in = indent + "    ";
+    os << (series_count == 1 ? "\n" : ",\n") << indent << "  {\n";
+    os << in << "\"series_uid\": " << json_string(first.series_uid) << ",\n";
+    os << in << "\"series_identifier\": " << json_string(s.identifier) << ",\n";
+    os << in << "\"modality\": " << json_string(first.modality) << ",\n";
+    os << in << "\"description\": " << json_string(first.description) << ",\n";
+    os << in << "\"series_number\": " << json_string(first.series_number) << ",\n";
+    os << in << "\"series_date\": " << json_string(first.series_date) << ",\n";
+    os << in << "\"files\": " << s.slices.size() << ",\n";
+    os << in << "\"size\": [" << first.columns << ", " << first.rows << ", " << uint64_t(first.frames) * s.slices.size() << "],\n";
+    os << in << "\"photometric\": " << json_string(first.photometric) << ",\n";
+    os << in << "\"bits_allocated\": " << first.bits_allocated << ",\n";
+    os << in << "\"transfer_syntax\": " << json_string(first.transfer_syntax) << ",\n";
+    os << in << "\"component_type\": " << json_string(itk::ImageIOBase::GetComponentTypeAsString(componentType)) << ",\n";
+    os << in << "\"samples_per_pixel\": " << first.samples_per_pixel << ",\n";
+    os << in << "\"output_bytes\": " << peak / 2 << ",\n"; // uncompressed voxels
+    os << in << "\"estimated_memory_bytes\": " << peak << ",\n";
+    if (first.modality == "PT") {
+      os << in << "\"suv_error\": " << json_string(first.suv_error) << ",\n";
+    }
+    os << in << "\"output\": " << json_string(outFileName) << "\n";
+    os << indent << "  }";
+  }
+  os << (series_count == 0 ? "]\n" : "\n" + indent + "  ]\n");
+  os << indent << "}";
+}
+
+/// <summary>
+/// Print the inventory of the inputs as JSON without reading pixel data: an object for a single input,
+/// an array of them for --batch. Inputs which can't be scanned have an "error" instead of "series".
+/// </summary>
+int probe_inputs(const Args& base, const std::vector<std::string>& inputs, bool batch)
+{
+  auto index = open_index(base);
+  int ret = EXIT_SUCCESS;
+  const std::string indent = batch ? "  " : "";
+  if (batch) {
+    cout << "[";
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    Args args = base;
+    args.input = inputs[i];
+    if (batch && args.outdir.empty()) {
+      args.outdir = fs::path(args.input).parent_path().string();
+    }
+    if (batch) {
+      cout << (i == 0 ? "\n" : ",\n");
+    }
+    try {
+      if (!fs::exists(args.input)) {
+        throw std::runtime_error("Could not find input(" + args.input + ").");
       }
+      write_inventory(cout, args, scan_input(args, index.get()), indent);
+    }
+    catch (std::exception& ex) {
+      cout << indent << "{ \"input\": " << json_string(args.input) << ", \"error\": " << json_string(ex.what()) << " }";
+      ret = EXIT_FAILURE;
+    }
+  }
+  cout << (batch ? (inputs.empty() ? "]\n" : "\n]\n") : "\n");
+  return ret;
+}
 
-      switch (dimension) {
-      case 2:
-        read_n_write<2>(fileNames, outFileName, componentType, args.compress);
-        break;
-      case 3:
-        read_n_write<3>(fileNames, outFileName, componentType, args.compress);
-        break;
+/// <summary>
+/// Convert inputs one after another in this process, sharing the worker pool, the memory budget and the header index.
+/// The next input is scanned in the background while the series of the current input are converted.
+/// </summary>
+int batch_input(const Args& base, const std::vector<std::string>& inputs)
+{
+  Workers workers(base);
+  auto index = open_index(base);
+  auto input_args = [&base, &workers](const std::string& input) {
+    Args args = workers.attach(base);
+    args.input = input;
+    if (args.outdir.empty()) {
+      args.outdir = fs::path(input).parent_path().string();
+    }
+    return args;
+  };
+  auto scan = [&index](const Args& args) {
+    if (!fs::exists(args.input)) {
+      throw std::runtime_error("Could not find input(" + args.input + ").");
+    }
+    return scan_input(args, index.get());
+  };
+
+  struct Result {
+    std::string input;
+    size_t n_series = 0;
+    int ret = EXIT_FAILURE;
+    std::string error;
+  };
+  std::vector<Result> results;
+  std::future<DicomInput> next;
+  if (!inputs.empty()) {
+    next = std::async(std::launch::async, scan, input_args(inputs.front()));
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    auto args = input_args(inputs[i]);
+    Result result;
+    result.input = inputs[i];
+    try {
+      auto scanned = next.get();
+      if (i + 1 < inputs.size()) {
+        next = std::async(std::launch::async, scan, input_args(inputs[i + 1]));
+      }
+      result.n_series = scanned.series.size();
+      result.ret = convert_input(args, workers, scanned);
+    }
+    catch (std::exception& ex) {
+      result.error = ex.what();
+      cerr << inputs[i] << ": " << ex.what() << endl;
+      if (i + 1 < inputs.size() && !next.valid()) {
+        next = std::async(std::launch::async, scan, input_args(inputs[i + 1]));
       }
     }
+    results.push_back(result);
   }
-  catch (itk::ExceptionObject& ex)
-  {
-    cout << ex << endl;
-    return EXIT_FAILURE;
+
+  if (workers.write_stage) {
+    workers.write_stage->wait();
   }
-  return EXIT_SUCCESS;
+  size_t n_failed = 0;
+  cout << "Batch report:" << endl;
+  for (const auto& r : results) {
+    n_failed += r.ret != EXIT_SUCCESS;
+    cout << (r.ret == EXIT_SUCCESS ? "OK    " : "FAILED") << " " << r.input << " (" << r.n_series << " series)";
+    if (!r.error.empty()) {
+      cout << " " << r.error;
+    }
+    cout << endl;
+  }
+  cout << results.size() - n_failed << " succeeded, " << n_failed << " failed" << endl;
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-int zipped_input(const Args& args)
+volatile std::sig_atomic_t interrupted = 0;
+
+/// <summary>
+/// Convert inputs (directories or zip files) dropped in the inbox until interrupted (Ctrl+C or SIGTERM).
+/// An input is converted once it has not changed for settle seconds, into a directory of its name under outdir,
+/// with the worker pool, the write stage and the header index kept for the whole run.
+/// Processed inputs are recorded in outdir/.dcm2itk-watch so that a restart does not convert them again.
+/// </summary>
+int watch_input(const Args& base, const std::string& inbox, unsigned interval, unsigned settle)
 {
-  ZipReader reader(args.input.c_str());
-  if (reader.err != MZ_OK) {
-    cerr << "MZ error:" << reader.err << endl;
-    return EXIT_FAILURE;
+  Workers workers(base);
+  auto index = open_index(base);
+  InboxWatcher watcher(inbox, (fs::path(base.outdir) / ".dcm2itk-watch").string(), std::chrono::seconds(settle));
+  std::signal(SIGINT, [](int) { interrupted = 1; });
+  std::signal(SIGTERM, [](int) { interrupted = 1; });
+  cout << "Watching: " << inbox << endl;
+  while (!interrupted) {
+    std::vector<InboxEntry> ready;
+    try {
+      ready = watcher.poll();
+    }
+    catch (std::exception& ex) {
+      cerr << ex.what() << endl;
+    }
+    for (const auto& entry : ready) {
+      if (interrupted) {
+        break;
+      }
+      fs::path input(entry.path);
+      Args args = workers.attach(base);
+      args.input = entry.path;
+      args.outdir = (fs::path(base.outdir) / (is_zip_input(entry.path) ? input.stem() : input.filename())).string();
+      int ret = EXIT_FAILURE;
+      try {
+        fs::create_directories(args.outdir);
+        ret = convert_input(args, workers, scan_input(args, index.get()));
+        if (workers.write_stage) {
+          workers.write_stage->wait();
+        }
+      }
+      catch (std::exception& ex) {
+        cerr << entry.path << ": " << ex.what() << endl;
+      }
+      cout << (ret == EXIT_SUCCESS ? "Converted: " : "Failed: ") << entry.path << endl;
+      try {
+        watcher.done(entry, ret == EXIT_SUCCESS);
+      }
+      catch (std::exception& ex) {
+        cerr << ex.what() << endl;
+      }
+    }
+    for (unsigned i = 0; i < interval && !interrupted; ++i) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
   }
-  auto temp_dir = TempDir::New(args.tmpdir);
-  auto temp_dir_str = temp_dir.path.string();
-  mz_zip_reader_save_all(reader.zip_reader, temp_dir_str.c_str());
-  Args new_args(args);
-  new_args.input = temp_dir_str;
-  return dir_input(new_args);
+  cout << "Stopped watching: " << inbox << endl;
+  return EXIT_SUCCESS;
 }
 
 int main(int argc, char* argv[])
@@ -406,7 +1295,7 @@ int main(int argc, char* argv[])
   try {
     TCLAP::CmdLine cmd("Simple DICOM to ITK image converter", ' ', PROJECT_VERSION " bulit in " __DATE__);
 
-    TCLAP::UnlabeledValueArg<std::string> inputDir("input", "Input directory or zip file containing dicom files", true, "", "input");
+    TCLAP::UnlabeledValueArg<std::string> inputDir("input", "Input directory or zip file containing dicom files. Not used with --batch or --watch.", false, "", "input");
     cmd.add(inputDir);
     TCLAP::UnlabeledValueArg<std::string> output("output", "(optional) Output filename. Series name (series number if series name is missing) is used by default.", false, "", "output");
     cmd.add(output);
@@ -417,9 +1306,59 @@ int main(int argc, char* argv[])
     TCLAP::ValueArg<std::string> extArg("e", "ext", "File extension. default: (" + args.ext + ")", false, args.ext, "ext");
     cmd.add(extArg);
     TCLAP::SwitchArg compressSwitch("","compress","Force compression.", cmd, false);
+    TCLAP::ValueArg<unsigned> jobsArg("j", "jobs", "Number of series converted in parallel. 0 uses all cores. default: 1", false, 1, "N", cmd);
+    TCLAP::ValueArg<uint64_t> ramArg("", "ram-budget", "(optional) Memory budget in MB shared by series converted in parallel. default: unlimited", false, 0, "MB", cmd);
+    std::vector<std::string> readers{ "parallel", "itk", "compare" };
+    TCLAP::ValuesConstraint<std::string> readerConstraint(readers);
+    TCLAP::ValueArg<std::string> readerArg("", "reader", "DICOM series reader. parallel: decode slices in parallel, itk: itk::ImageSeriesReader, compare: run both and report timings and differences. default: parallel", false, "parallel", &readerConstraint, cmd);
+    TCLAP::ValueArg<unsigned> compressThreadsArg("", "compress-threads", "Number of threads compressing .nii.gz and .mha output. 0 uses all cores. default: 0", false, 0, "N", cmd);
+    TCLAP::ValueArg<int> compressLevelArg("", "compress-level", "zlib compression level (1-9) of .nii.gz and .mha output. default: 6", false, 6, "level", cmd);
+    TCLAP::ValueArg<std::string> batchArg("", "batch", "(optional) File listing inputs (directories or zip files) one per line, or - for stdin. The inputs are converted in one process.", false, "", "filename", cmd);
+    TCLAP::ValueArg<std::string> watchArg("", "watch", "(optional) Inbox directory. Directories and zip files which stop changing in it are converted into --outdir until interrupted.", false, "", "dirname", cmd);
+    TCLAP::ValueArg<unsigned> watchIntervalArg("", "watch-interval", "Seconds between looks at the inbox of --watch. default: 5", false, 5, "seconds", cmd);
+    TCLAP::ValueArg<unsigned> settleArg("", "settle", "Seconds an input of --watch must stay unchanged before it is converted. default: 30", false, 30, "seconds", cmd);
+    TCLAP::ValueArg<std::string> indexArg("", "index", "(optional) Header index file. Headers of unchanged files are read from the index instead of being parsed again. Directory input only.", false, "", "filename", cmd);
+    std::vector<std::string> outputTypes{ "native", "uint8", "int8", "uint16", "int16", "uint32", "int32", "float", "double" };
+    TCLAP::ValuesConstraint<std::string> outputTypeConstraint(outputTypes);
+    TCLAP::ValueArg<std::string> outputTypeArg("", "output-type", "Pixel type of grayscale output. Values out of range are clamped. native: the type of the rescaled series. default: native", false, "native", &outputTypeConstraint, cmd);
+    TCLAP::SwitchArg probeSwitch("", "probe", "Print series metadata (size, pixel type, estimated bytes, output name) of the input or --batch inputs as JSON without reading pixel data or converting.", cmd, false);
+    TCLAP::SwitchArg statsSwitch("", "stats", "Print time, throughput and peak memory of each stage (scan, decode, suv, write, stream) at the end.", cmd, false);
+    TCLAP::ValueArg<std::string> statsJsonArg("", "stats-json", "(optional) Write the stats as JSON to the file (- for stdout, stderr with --probe).", false, "", "filename", cmd);
+    TCLAP::ValueArg<uint64_t> maxMemoryArg("", "max-memory", "(optional) Memory limit in MB of a series. Larger series are read and written in z-slabs, which needs .nii, .nrrd or uncompressed .mha output. default: unlimited", false, 0, "MB", cmd);
+    TCLAP::SwitchArg noPipelineArg("", "no-pipeline", "Write each series before reading the next one. By default a series is compressed and written in the background while the next one is read (--jobs 1 without --ram-budget or --max-memory only).", cmd, false);
+    TCLAP::SwitchArg noMmapArg("", "no-mmap", "Decode uncompressed files with gdcm instead of copying the pixel data from memory mapped files (parallel reader)", cmd, false);
+    TCLAP::SwitchArg forceSwitch("", "force", "Convert series again even if the manifest records them as unchanged.", cmd, false);
+    TCLAP::SwitchArg noManifestSwitch("", "no-manifest", "Don't read or write .dcm2itk-manifest in the output directory. Every series is converted, and names taken by existing files get a _(i) suffix.", cmd, false);
+    TCLAP::ValueArg<std::string> shardArg("", "shard", "Convert the i-th (0 based) of N disjoint subsets of the series, e.g. 0/4, for N processes sharing the work. Series are split by estimated size and a hash of their UIDs, outputs are named as in a single run into an empty directory, and dcm2itk-shard-i-of-N.tsv lists the series of the shard in --outdir (the current directory for --batch without --outdir).", false, "", "i/N", cmd);
+    TCLAP::MultiArg<std::string> modalityArg("", "modality", "Convert only series of the modality (e.g. CT). Can be repeated.", false, "modality", cmd);
+    TCLAP::MultiArg<std::string> seriesUidArg("", "series-uid", "Convert only the series with the SeriesInstanceUID. Can be repeated.", false, "uid", cmd);
+    TCLAP::ValueArg<unsigned> minSlicesArg("", "min-slices", "Skip series with fewer slices. default: 0", false, 0, "N", cmd);
+    TCLAP::ValueArg<std::string> descriptionArg("", "description", "Convert only series whose SeriesDescription matches the regular expression (case insensitive).", false, "", "regex", cmd);
+    TCLAP::SwitchArg excludeLocalizersSwitch("", "exclude-localizers", "Skip series whose ImageType contains LOCALIZER or SCOUT.", cmd, false);
+    TCLAP::ValueArg<unsigned> decodeThreadsArg("", "decode-threads", "Number of threads parsing headers and decoding slices of a series. 0 uses all cores. default: 0", false, 0, "N", cmd);
 
     cmd.parse(argc, argv);
 
+    if (int(inputDir.isSet()) + int(batchArg.isSet()) + int(watchArg.isSet()) != 1) {
+      cerr << "Fatal error: Specify one of <input>, --batch and --watch." << endl;
+      return EXIT_FAILURE;
+    }
+    if (watchArg.isSet() && !outdir.isSet()) {
+      cerr << "Fatal error: --watch needs --outdir." << endl;
+      return EXIT_FAILURE;
+    }
+    if (watchArg.isSet() && shardArg.isSet()) {
+      cerr << "Fatal error: --shard can't be used with --watch." << endl;
+      return EXIT_FAILURE;
+    }
+    if (watchArg.isSet() && probeSwitch.isSet()) {
+      cerr << "Fatal error: --probe can't be used with --watch." << endl;
+      return EXIT_FAILURE;
+    }
+    if (watchArg.isSet() && !fs::is_directory(watchArg.getValue())) {
+      cerr << "Fatal error: Could not find inbox(" << watchArg.getValue() << ")." << endl;
+      return EXIT_FAILURE;
+    }
     args.input = inputDir.getValue();
     if (output.isSet()) {
       args.output = output.getValue();
@@ -432,12 +1371,48 @@ int main(int argc, char* argv[])
       if (outdir.isSet()) {
         args.outdir = outdir.getValue();
       }
-      else {
+      else if (inputDir.isSet()) { // each input of a batch is converted next to itself
         args.outdir = fs::path(args.input).parent_path().string();
       }
     }
     args.ext = extArg.getValue();
     args.compress = compressSwitch;
+    args.compress_options.threads = compressThreadsArg.getValue();
+    args.compress_options.level = compressLevelArg.getValue();
+    if (args.compress_options.level < 1 || args.compress_options.level > 9) {
+      cerr << "Fatal error: Invalid compression level(" << args.compress_options.level << ")." << endl;
+      return EXIT_FAILURE;
+    }
+    args.jobs = jobsArg.getValue();
+    args.ram_budget = ramArg.getValue() * 1024 * 1024;
+    args.max_memory = maxMemoryArg.getValue() * 1024 * 1024;
+    args.reader = readerArg.getValue();
+    args.decode_threads = decodeThreadsArg.getValue();
+    args.map_files = !noMmapArg.getValue();
+    args.probe = probeSwitch.getValue();
+    args.force = forceSwitch.getValue();
+    args.use_manifest = !noManifestSwitch.getValue();
+    args.filter.modalities = modalityArg.getValue();
+    args.filter.series_uids = seriesUidArg.getValue();
+    args.filter.min_slices = minSlicesArg.getValue();
+    args.filter.description = descriptionArg.getValue();
+    args.filter.exclude_localizers = excludeLocalizersSwitch.getValue();
+    try {
+      std::regex validate(args.filter.description, std::regex::ECMAScript | std::regex::icase);
+    }
+    catch (std::regex_error& ex) {
+      cerr << "Fatal error: Invalid --description(" << args.filter.description << "): " << ex.what() << endl;
+      return EXIT_FAILURE;
+    }
+    args.pipeline = !noPipelineArg.getValue();
+    args.index = indexArg.getValue();
+    const std::map<std::string, itk::ImageIOBase::IOComponentType> output_types{
+      { "native", itk::ImageIOBase::UNKNOWNCOMPONENTTYPE },
+      { "uint8", itk::ImageIOBase::UCHAR }, { "int8", itk::ImageIOBase::CHAR },
+      { "uint16", itk::ImageIOBase::USHORT }, { "int16", itk::ImageIOBase::SHORT },
+      { "uint32", itk::ImageIOBase::UINT }, { "int32", itk::ImageIOBase::INT },
+      { "float", itk::ImageIOBase::FLOAT }, { "double", itk::ImageIOBase::DOUBLE } };
+    args.output_type = output_types.at(outputTypeArg.getValue());
     if (tmpdir.isSet()) {
       args.tmpdir = tmpdir.getValue();
     }
@@ -446,21 +1421,76 @@ int main(int argc, char* argv[])
     }
 
 
-    if (!fs::exists(args.input)) {
-      cerr << "Fatal error: Could not find input(" << args.input << ")." << endl;
-      return EXIT_FAILURE;
-    }
     if (args.outdir != "" && !fs::exists(args.outdir)) {
       cerr << "Fatal error: Could not find outdir(" << args.outdir << ")." << endl;
       return EXIT_FAILURE;
     }
-
-    if (fs::path(args.input).extension() == ".zip") {
-      return zipped_input(args);
+    if (inputDir.isSet() && !fs::exists(args.input)) {
+      cerr << "Fatal error: Could not find input(" << args.input << ")." << endl;
+      return EXIT_FAILURE;
+    }
+    std::ofstream shard_manifest;
+    if (shardArg.isSet()) {
+      const auto& shard = shardArg.getValue();
+      auto slash = shard.find('/');
+      try {
+        args.shard = std::stoul(shard.substr(0, slash));
+        args.n_shards = slash == std::string::npos ? 0 : std::stoul(shard.substr(slash + 1));
+      }
+      catch (std::exception&) {
+        args.n_shards = 0;
+      }
+      if (args.n_shards == 0 || args.shard >= args.n_shards) {
+        cerr << "Fatal error: Invalid --shard(" << shard << "). Give i/N with 0 <= i < N." << endl;
+        return EXIT_FAILURE;
+      }
+      auto dir = outdir.isSet() || !batchArg.isSet() ? fs::path(args.outdir) : fs::current_path();
+      auto manifest = dir / ("dcm2itk-shard-" + std::to_string(args.shard) + "-of-" + std::to_string(args.n_shards) + ".tsv");
+      if (!args.probe) {
+        shard_manifest.open(manifest);
+        if (!shard_manifest) {
+          cerr << "Fatal error: Could not write: " << manifest.string() << endl;
+          return EXIT_FAILURE;
+        }
+        shard_manifest << "input\tseries_uid\tseries_identifier\testimated_bytes\toutput\tstatus\n";
+        args.shard_manifest = &shard_manifest;
+      }
+    }
+    std::unique_ptr<Stats> stats;
+    if (statsSwitch.getValue() || statsJsonArg.isSet()) {
+      stats = std::make_unique<Stats>();
+      args.stats = stats.get();
+    }
+    int ret;
+    if (args.probe) {
+      ret = batchArg.isSet() ? probe_inputs(args, read_input_list(batchArg.getValue()), true) : probe_inputs(args, { args.input }, false);
+    }
+    else if (watchArg.isSet()) {
+      ret = watch_input(args, watchArg.getValue(), watchIntervalArg.getValue(), settleArg.getValue());
+    }
+    else if (batchArg.isSet()) {
+      ret = batch_input(args, read_input_list(batchArg.getValue()));
     }
     else {
-      return dir_input(args);
+      ret = single_input(args);
+    }
+    auto& stats_os = args.probe ? cerr : cout; // stdout is kept for the inventory
+    if (statsSwitch.getValue()) {
+      stats->print(stats_os);
+    }
+    if (statsJsonArg.isSet()) {
+      if (statsJsonArg.getValue() == "-") {
+        stats->write_json(stats_os);
+      }
+      else {
+        std::ofstream ofs(statsJsonArg.getValue());
+        stats->write_json(ofs);
+        if (!ofs) {
+          cerr << "Could not write: " << statsJsonArg.getValue() << endl;
+        }
+      }
     }
+    return ret;
   }
   catch (TCLAP::ArgException& e)
   {
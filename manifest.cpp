@@ -0,0 +1,94 @@
+#include "manifest.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+  const std::string manifest_magic = "dcm2itk-manifest\t1";
+
+  /// Tabs and newlines would break the line format
+  std::string field(std::string s)
+  {
+    std::replace_if(s.begin(), s.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+    return s;
+  }
+}
+
+OutputManifest::OutputManifest(const std::string& filename)
+  : filename(filename)
+{
+  std::ifstream ifs(filename, std::ios::binary);
+  std::string line;
+  if (!ifs || !std::getline(ifs, line) || line != manifest_magic) {
+    return;
+  }
+  while (std::getline(ifs, line)) {
+    // series, fingerprint, options, input and output
+    std::string fields[5];
+    size_t begin = 0;
+    for (int i = 0; i < 4 && begin != std::string::npos; ++i) {
+      auto end = line.find('\t', begin);
+      fields[i] = line.substr(begin, end == std::string::npos ? end : end - begin);
+      begin = end == std::string::npos ? end : end + 1;
+    }
+    if (begin == std::string::npos) {
+      continue;
+    }
+    fields[4] = line.substr(begin);
+    records[{ fields[3], fields[0] }] = { fields[1], fields[2], fields[3], fields[4] };
+  }
+}
+
+bool OutputManifest::find(const std::string& input, const std::string& series, ManifestRecord& record) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = records.find({ input, series });
+  if (it == records.end()) {
+    return false;
+  }
+  record = it->second;
+  return true;
+}
+
+void OutputManifest::expect(const std::string& series, const ManifestRecord& record)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  pending[record.output] = { series, record };
+}
+
+void OutputManifest::written(const std::string& output)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = pending.find(output);
+  if (it == pending.end()) {
+    return;
+  }
+  records[{ it->second.second.input, it->second.first }] = it->second.second;
+  pending.erase(it);
+  save();
+}
+
+void OutputManifest::save() const
+{
+  auto temp = filename + ".tmp";
+  {
+    std::ofstream ofs(temp, std::ios::binary);
+    ofs << manifest_magic << '\n';
+    for (const auto& r : records) {
+      ofs << field(r.first.second) << '\t' << field(r.second.fingerprint) << '\t' << field(r.second.options) << '\t'
+        << field(r.second.input) << '\t' << field(r.second.output) << '\n';
+    }
+    if (!ofs) {
+      throw std::runtime_error("Could not write manifest: " + temp);
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, filename, ec);
+  if (ec) {
+    throw std::runtime_error("Could not write manifest: " + filename + " (" + ec.message() + ")");
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+#include <map>
+#include <mutex>
+#include <string>
+
+struct ManifestRecord {
+  std::string fingerprint; // files of the series (see DicomInput::fingerprint)
+  std::string options;     // conversion options the output depends on
+  std::string input;
+  std::string output;
+};
+
+/// <summary>
+/// Outputs of the series converted into a directory, so that reruns skip series whose files and options are unchanged.
+/// Series are recorded once their output is written, and the file is saved after each of them so that
+/// an interrupted run keeps what it has finished. Thread safe.
+/// </summary>
+class OutputManifest
+{
+public:
+  /// <summary>
+  /// Load the manifest. A missing file or one of another version is an empty manifest.
+  /// </summary>
+  explicit OutputManifest(const std::string& filename);
+
+  /// <returns>false if the series of the input is not recorded</returns>
+  bool find(const std::string& input, const std::string& series, ManifestRecord& record) const;
+
+  /// <summary>
+  /// The series of record.input is being converted to record.output. It is recorded when written() is called for the output.
+  /// </summary>
+  void expect(const std::string& series, const ManifestRecord& record);
+
+  /// <summary>
+  /// Record the series expected for the output and save the manifest.
+  /// std::runtime_error is thrown if the manifest can't be written.
+  /// </summary>
+  void written(const std::string& output);
+
+private:
+  void save() const;
+
+  std::string filename;
+  mutable std::mutex mutex;
+  // by input and series identifier, as inputs of a batch may share an output directory and have series of the same identifier
+  std::map<std::pair<std::string, std::string>, ManifestRecord> records;
+  std::map<std::string, std::pair<std::string, ManifestRecord>> pending; // by output
+};
+
+#endif /* MANIFEST_H */
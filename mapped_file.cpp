@@ -0,0 +1,126 @@
+#include "mapped_file.h"
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& filename)
+{
+#ifdef _WIN32
+  auto handle = CreateFileW(std::filesystem::path(filename).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return;
+  }
+  file = handle;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+    return;
+  }
+  mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    return;
+  }
+  auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (view == NULL) {
+    return;
+  }
+  addr = static_cast<const char*>(view);
+  length = static_cast<size_t>(size.QuadPart);
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    auto view = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (view != MAP_FAILED) {
+      addr = static_cast<const char*>(view);
+      length = static_cast<size_t>(st.st_size);
+      madvise(view, length, MADV_SEQUENTIAL);
+    }
+  }
+  close(fd); // the mapping stays valid
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+  if (addr) {
+    UnmapViewOfFile(addr);
+  }
+  if (mapping) {
+    CloseHandle(mapping);
+  }
+  if (file) {
+    CloseHandle(file);
+  }
+#else
+  if (addr) {
+    munmap(const_cast<char*>(addr), length);
+  }
+#endif
+}
+
+namespace
+{
+  uint32_t read_u32(const unsigned char* p, bool big_endian)
+  {
+    return big_endian ? (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3]
+      : (uint32_t(p[3]) << 24) | (uint32_t(p[2]) << 16) | (uint32_t(p[1]) << 8) | p[0];
+  }
+}
+
+const char* find_pixel_data(const char* data, size_t size, size_t expected_length, bool implicit_vr, bool big_endian)
+{
+  const size_t header_length = implicit_vr ? 8 : 12;
+  if (size < header_length + expected_length) {
+    return nullptr;
+  }
+  const unsigned char tag_le[4] = { 0xe0, 0x7f, 0x10, 0x00 };
+  const unsigned char tag_be[4] = { 0x7f, 0xe0, 0x00, 0x10 };
+  const auto tag = big_endian ? tag_be : tag_le;
+  auto bytes = reinterpret_cast<const unsigned char*>(data);
+  auto is_pixel_data = [&](size_t pos) {
+    auto p = bytes + pos;
+    if (std::memcmp(p, tag, 4) != 0) {
+      return false;
+    }
+    uint32_t value_length;
+    if (implicit_vr) {
+      value_length = read_u32(p + 4, big_endian);
+    }
+    else {
+      bool ow_ob = (p[4] == 'O' && (p[5] == 'W' || p[5] == 'B')) || (p[4] == 'U' && p[5] == 'N');
+      if (!ow_ob || p[6] != 0 || p[7] != 0) {
+        return false;
+      }
+      value_length = read_u32(p + 8, big_endian);
+    }
+    return (value_length == expected_length || value_length == expected_length + 1)
+      && pos + header_length + value_length <= size;
+  };
+  // Pixel data is usually the last element
+  for (size_t padding = 0; padding < 2; ++padding) {
+    auto pos = size - header_length - expected_length - padding;
+    if (size >= header_length + expected_length + padding && is_pixel_data(pos)) {
+      return data + pos + header_length;
+    }
+  }
+  // followed by trailing elements (e.g. data set trailing padding)
+  for (size_t pos = size - header_length - expected_length + 1; pos-- > 0;) {
+    if (is_pixel_data(pos)) {
+      return data + pos + header_length;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,37 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+#include <cstddef>
+#include <string>
+
+/// <summary>
+/// Read-only memory mapping of a whole file. data() is nullptr if the file could not be mapped.
+/// </summary>
+class MappedFile
+{
+public:
+  explicit MappedFile(const std::string& filename);
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return addr; }
+  size_t size() const { return length; }
+
+private:
+  const char* addr = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  void* file = nullptr;
+  void* mapping = nullptr;
+#endif
+};
+
+/// <summary>
+/// Locate the value of the top level Pixel Data (7FE0,0010) of a native (uncompressed) encoding.
+/// The element is looked for from the end of the file and accepted only if its length is
+/// expected_length (or one more byte of padding), so the pixel data of icons in sequences is not picked up.
+/// </summary>
+/// <returns>nullptr if not found</returns>
+const char* find_pixel_data(const char* data, size_t size, size_t expected_length, bool implicit_vr, bool big_endian);
+
+#endif /* MAPPED_FILE_H */
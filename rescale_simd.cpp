@@ -0,0 +1,159 @@
+#include "rescale_simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DCM2ITK_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#ifdef DCM2ITK_X86
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DCM2ITK_AVX2 __attribute__((target("avx2")))
+#else
+#define DCM2ITK_AVX2 // MSVC compiles intrinsics without /arch:AVX2
+#endif
+
+namespace
+{
+  bool detect_avx2()
+  {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+      return false;
+    }
+    __cpuid(info, 1);
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || (_xgetbv(0) & 6) != 6) { // YMM state is not saved by the OS
+      return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+  }
+
+  bool has_avx2()
+  {
+    static const bool supported = detect_avx2();
+    return supported;
+  }
+
+  /// 8 values widened to 32 bit integers
+  DCM2ITK_AVX2 inline __m256i load8(const int16_t* in)
+  {
+    return _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)));
+  }
+  DCM2ITK_AVX2 inline __m256i load8(const uint16_t* in)
+  {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)));
+  }
+
+  /// 8 rescaled values as two vectors of 4 doubles
+  struct Rescaled {
+    __m256d lo;
+    __m256d hi;
+  };
+
+  DCM2ITK_AVX2 inline void store8(float* out, const Rescaled& v)
+  {
+    _mm_storeu_ps(out, _mm256_cvtpd_ps(v.lo));
+    _mm_storeu_ps(out + 4, _mm256_cvtpd_ps(v.hi));
+  }
+  DCM2ITK_AVX2 inline void store8(double* out, const Rescaled& v)
+  {
+    _mm256_storeu_pd(out, v.lo);
+    _mm256_storeu_pd(out + 4, v.hi);
+  }
+  /// clamped first since the conversion of out of range values is undefined, then truncated as static_cast.
+  /// maxpd returns its second operand for NaN, so NaN is clamped to lowest like saturate does
+  DCM2ITK_AVX2 inline __m128i truncate(__m256d v, double lowest, double highest)
+  {
+    v = _mm256_min_pd(_mm256_max_pd(v, _mm256_set1_pd(lowest)), _mm256_set1_pd(highest));
+    return _mm256_cvttpd_epi32(v);
+  }
+  DCM2ITK_AVX2 inline void store8(int16_t* out, const Rescaled& v)
+  {
+    auto packed = _mm_packs_epi32(truncate(v.lo, -32768.0, 32767.0), truncate(v.hi, -32768.0, 32767.0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+  }
+  DCM2ITK_AVX2 inline void store8(uint16_t* out, const Rescaled& v)
+  {
+    auto packed = _mm_packus_epi32(truncate(v.lo, 0.0, 65535.0), truncate(v.hi, 0.0, 65535.0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+  }
+
+  template <typename TIn, typename TOut>
+  DCM2ITK_AVX2 size_t rescale_avx2(const TIn* in, TOut* out, size_t n, double slope, double intercept)
+  {
+    const auto s = _mm256_set1_pd(slope);
+    const auto b = _mm256_set1_pd(intercept);
+    const size_t end = n - n % 8;
+    for (size_t i = 0; i < end; i += 8) {
+      auto v = load8(in + i);
+      // multiply and add separately as the scalar loop does (no FMA)
+      Rescaled r;
+      r.lo = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), s), b);
+      r.hi = _mm256_add_pd(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), s), b);
+      store8(out + i, r);
+    }
+    return end;
+  }
+
+  template <typename TIn, typename TOut>
+  size_t dispatch(const TIn* in, TOut* out, size_t n, double slope, double intercept)
+  {
+    return has_avx2() ? rescale_avx2(in, out, n, slope, intercept) : 0;
+  }
+}
+
+#else
+
+namespace
+{
+  template <typename TIn, typename TOut>
+  size_t dispatch(const TIn*, TOut*, size_t, double, double)
+  {
+    return 0;
+  }
+}
+
+#endif
+
+size_t rescale_copy_avx2(const int16_t* in, float* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const int16_t* in, double* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const int16_t* in, int16_t* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const int16_t* in, uint16_t* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const uint16_t* in, float* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const uint16_t* in, double* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const uint16_t* in, int16_t* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
+size_t rescale_copy_avx2(const uint16_t* in, uint16_t* out, size_t n, double slope, double intercept)
+{
+  return dispatch(in, out, n, slope, intercept);
+}
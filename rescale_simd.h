@@ -0,0 +1,30 @@
+#ifndef RESCALE_SIMD_H
+#define RESCALE_SIMD_H
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/// <summary>
+/// Whether rescale_copy_avx2 is available for the pair of types: 16 bit stored values (CT, PET)
+/// to the output types they are usually rescaled to.
+/// </summary>
+template <typename TIn, typename TOut>
+constexpr bool has_avx2_rescale = (std::is_same_v<TIn, int16_t> || std::is_same_v<TIn, uint16_t>)
+  && (std::is_same_v<TOut, float> || std::is_same_v<TOut, double> || std::is_same_v<TOut, int16_t> || std::is_same_v<TOut, uint16_t>);
+
+/// <summary>
+/// AVX2 kernels of the rescaling loop of rescale_copy (volume.h), selected at run time.
+/// out[i] = in[i] * slope + intercept is computed in double and converted (with saturation for integers)
+/// in the same manner as the scalar loop, so the results are identical.
+/// </summary>
+/// <returns>number of leading values written, a multiple of the vector width. 0 if the CPU lacks AVX2</returns>
+size_t rescale_copy_avx2(const int16_t* in, float* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const int16_t* in, double* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const int16_t* in, int16_t* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const int16_t* in, uint16_t* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const uint16_t* in, float* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const uint16_t* in, double* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const uint16_t* in, int16_t* out, size_t n, double slope, double intercept);
+size_t rescale_copy_avx2(const uint16_t* in, uint16_t* out, size_t n, double slope, double intercept);
+
+#endif /* RESCALE_SIMD_H */
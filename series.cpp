@@ -0,0 +1,455 @@
+#include "series.h"
+#include "thread_pool.h"
+#include "index_cache.h"
+#include <gdcmReader.h>
+#include <gdcmStringFilter.h>
+#include <mz.h>
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+
+namespace
+{
+  std::string trim(const std::string& s)
+  {
+    auto is_pad = [](char c) { return c == ' ' || c == '\0'; };
+    auto begin = std::find_if_not(s.begin(), s.end(), is_pad);
+    auto end = std::find_if_not(s.rbegin(), s.rend(), is_pad).base();
+    return begin < end ? std::string(begin, end) : std::string();
+  }
+
+  std::vector<double> to_doubles(const std::string& s)
+  {
+    std::vector<double> values;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, '\\')) {
+      try {
+        values.push_back(std::stod(item));
+      }
+      catch (std::exception&) {
+        return {};
+      }
+    }
+    return values;
+  }
+
+  unsigned to_unsigned(const std::string& s, unsigned default_value)
+  {
+    try {
+      return s.empty() ? default_value : static_cast<unsigned>(std::stoul(s));
+    }
+    catch (std::exception&) {
+      return default_value;
+    }
+  }
+
+  /// same as gdcm::SerieHelper::CreateUniqueSeriesIdentifier
+  std::string create_series_identifier(const std::string& uid, const std::vector<std::string>& details)
+  {
+    auto id = uid;
+    for (const auto& s : details) {
+      if (id == uid && !s.empty()) {
+        id += ".";
+      }
+      id += s;
+    }
+    auto is_valid = [](char c) {
+      return c == '.' || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z');
+    };
+    id.erase(std::remove_if(id.begin(), id.end(), [&](char c) { return !is_valid(c); }), id.end());
+    return id;
+  }
+
+  bool position_ordering(std::vector<SliceHeader>& slices)
+  {
+    for (const auto& s : slices) {
+      if (!s.has_position) {
+        return false;
+      }
+    }
+    const auto& c = slices.front().orientation;
+    double normal[3] = {
+      c[1] * c[5] - c[2] * c[4],
+      c[2] * c[3] - c[0] * c[5],
+      c[0] * c[4] - c[1] * c[3] };
+    std::vector<std::pair<double, size_t>> dists;
+    for (size_t i = 0; i < slices.size(); ++i) {
+      const auto& p = slices[i].position;
+      dists.emplace_back(normal[0] * p[0] + normal[1] * p[1] + normal[2] * p[2], i);
+    }
+    std::stable_sort(dists.begin(), dists.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    if (dists.front().first == dists.back().first) {
+      return false;
+    }
+    for (size_t i = 1; i < dists.size(); ++i) {
+      if (dists[i - 1].first == dists[i].first) { // position is not unique
+        return false;
+      }
+    }
+    std::vector<SliceHeader> sorted;
+    sorted.reserve(slices.size());
+    for (const auto& d : dists) {
+      sorted.push_back(std::move(slices[d.second]));
+    }
+    slices.swap(sorted);
+    return true;
+  }
+
+  bool instance_number_ordering(std::vector<SliceHeader>& slices)
+  {
+    int min = slices.front().instance_number;
+    int max = min;
+    for (const auto& s : slices) {
+      if (!s.has_instance_number) {
+        return false;
+      }
+      min = std::min(min, s.instance_number);
+      max = std::max(max, s.instance_number);
+    }
+    if (min == max || max == 0) {
+      return false;
+    }
+    std::stable_sort(slices.begin(), slices.end(), [](const auto& a, const auto& b) { return a.instance_number < b.instance_number; });
+    return true;
+  }
+
+  void order_slices(std::vector<SliceHeader>& slices)
+  {
+    if (position_ordering(slices) || instance_number_ordering(slices)) {
+      return;
+    }
+    std::stable_sort(slices.begin(), slices.end(), [](const auto& a, const auto& b) { return a.filename < b.filename; });
+  }
+
+  /// <summary>
+  /// Tags used by read_slice_header. Parsing stops after the last of them, and elements not in the set
+  /// (e.g. large private sequences) are skipped without being kept.
+  /// </summary>
+  const std::set<gdcm::Tag>& header_tags()
+  {
+    static const std::set<gdcm::Tag> tags = []() {
+      auto t = suv_tags();
+      t.insert({
+        { 0x0008, 0x0008 }, { 0x0008, 0x0021 }, { 0x0008, 0x103e },
+        { 0x0018, 0x0024 }, { 0x0018, 0x0050 },
+        { 0x0020, 0x000e }, { 0x0020, 0x0011 }, { 0x0020, 0x0013 }, { 0x0020, 0x0032 }, { 0x0020, 0x0037 },
+        { 0x0028, 0x0002 }, { 0x0028, 0x0004 }, { 0x0028, 0x0006 }, { 0x0028, 0x0008 }, { 0x0028, 0x0010 }, { 0x0028, 0x0011 },
+        { 0x0028, 0x0100 }, { 0x0028, 0x0101 }, { 0x0028, 0x0102 }, { 0x0028, 0x0103 } });
+      return t;
+    }();
+    return tags;
+  }
+
+  /// <summary>
+  /// Whether an archive entry may be a DICOM file judging from its name, so that DICOMDIR, reports,
+  /// thumbnails and the like are not inflated at all
+  /// </summary>
+  bool is_dicom_candidate(const std::string& name)
+  {
+    auto slash = name.find_last_of("/\\");
+    auto base = slash == std::string::npos ? name : name.substr(slash + 1);
+    std::string upper(base);
+    std::transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+    if (upper.empty() || upper == "DICOMDIR" || upper.compare(0, 2, "._") == 0 || name.compare(0, 9, "__MACOSX/") == 0) {
+      return false;
+    }
+    static const std::set<std::string> skipped = {
+      ".PDF", ".JPG", ".JPEG", ".PNG", ".GIF", ".BMP", ".TIF", ".TIFF", ".TXT", ".XML", ".HTM", ".HTML",
+      ".JSON", ".CSV", ".INI", ".INF", ".EXE", ".DLL", ".JS", ".CSS", ".ZIP", ".DB", ".DS_STORE" };
+    auto dot = upper.find_last_of('.');
+    return dot == std::string::npos || skipped.count(upper.substr(dot)) == 0;
+  }
+
+  /// <summary>
+  /// "DICM" after the 128 byte preamble, or a dataset without preamble starting with a group 0002 or 0008 tag
+  /// (little or big endian)
+  /// </summary>
+  bool has_dicom_signature(const std::vector<char>& buffer)
+  {
+    if (buffer.size() >= 132 && std::equal(buffer.begin() + 128, buffer.begin() + 132, "DICM")) {
+      return true;
+    }
+    auto is_group = [](char c) { return c == 0x02 || c == 0x08; };
+    return buffer.size() >= 4 && ((is_group(buffer[0]) && buffer[1] == 0x00) || (buffer[0] == 0x00 && is_group(buffer[1])));
+  }
+}
+
+bool read_slice_header(std::istream& is, SliceHeader& header)
+{
+  gdcm::Reader reader;
+  reader.SetStream(is);
+  if (!reader.ReadSelectedTags(header_tags())) {
+    return false;
+  }
+  gdcm::StringFilter sf;
+  sf.SetFile(reader.GetFile());
+  auto value = [&sf](uint16_t group, uint16_t element) {
+    return trim(sf.ToString(gdcm::Tag(group, element)));
+  };
+
+  header.rows = to_unsigned(value(0x0028, 0x0010), 0);
+  header.columns = to_unsigned(value(0x0028, 0x0011), 0);
+  if (header.rows == 0 || header.columns == 0) {
+    return false;
+  }
+  header.frames = to_unsigned(value(0x0028, 0x0008), 1);
+  header.samples_per_pixel = to_unsigned(value(0x0028, 0x0002), 1);
+  header.photometric = value(0x0028, 0x0004);
+  header.bits_allocated = to_unsigned(value(0x0028, 0x0100), 0);
+  header.bits_stored = to_unsigned(value(0x0028, 0x0101), header.bits_allocated);
+  header.high_bit = to_unsigned(value(0x0028, 0x0102), header.bits_stored > 0 ? header.bits_stored - 1 : 0);
+  header.pixel_representation = to_unsigned(value(0x0028, 0x0103), 0);
+  header.planar_configuration = to_unsigned(value(0x0028, 0x0006), 0);
+  auto ts = reader.GetFile().GetHeader().GetDataSetTransferSyntax().GetString();
+  header.transfer_syntax = ts ? trim(ts) : "";
+
+  header.series_uid = value(0x0020, 0x000e);
+  header.modality = value(0x0008, 0x0060);
+  header.description = value(0x0008, 0x103e);
+  header.series_number = value(0x0020, 0x0011);
+  header.series_date = value(0x0008, 0x0021);
+  header.image_type = value(0x0008, 0x0008);
+  auto instance_number = value(0x0020, 0x0013);
+  header.has_instance_number = !instance_number.empty();
+  if (header.has_instance_number) {
+    try {
+      header.instance_number = std::stoi(instance_number);
+    }
+    catch (std::exception&) {
+      header.has_instance_number = false;
+    }
+  }
+
+  auto position = to_doubles(value(0x0020, 0x0032));
+  auto orientation = to_doubles(value(0x0020, 0x0037));
+  header.has_position = position.size() == 3 && orientation.size() == 6;
+  if (header.has_position) {
+    std::copy(position.begin(), position.end(), header.position);
+    std::copy(orientation.begin(), orientation.end(), header.orientation);
+  }
+
+  auto slope = to_doubles(value(0x0028, 0x1053));
+  auto intercept = to_doubles(value(0x0028, 0x1052));
+  header.slope = slope.empty() ? 1.0 : slope.front();
+  header.intercept = intercept.empty() ? 0.0 : intercept.front();
+
+  if (header.modality == "PT") {
+    try {
+      header.suv = get_suv_params(reader.GetFile().GetDataSet());
+    }
+    catch (std::exception& ex) {
+      header.suv_error = ex.what();
+    }
+  }
+
+  // 0020|0011 series number, 0018|0024 sequence name, 0018|0050 slice thickness, 0028|0010 rows, 0028|0011 columns, 0008|0021 series date
+  header.series_identifier = create_series_identifier(header.series_uid,
+    { header.series_number, value(0x0018, 0x0024), value(0x0018, 0x0050),
+      value(0x0028, 0x0010), value(0x0028, 0x0011), header.series_date });
+  return true;
+}
+
+bool read_slice_header(const std::string& filename, SliceHeader& header)
+{
+  std::ifstream ifs(filename, std::ios::binary);
+  if (!ifs) {
+    return false;
+  }
+  header.filename = filename;
+  return read_slice_header(ifs, header);
+}
+
+std::vector<SliceHeader> scan_directory(const std::string& dirname, unsigned n_threads, HeaderIndex* index)
+{
+  namespace fs = std::filesystem;
+  std::vector<std::pair<std::string, IndexedFile>> files;
+  std::vector<size_t> to_parse;
+  for (const auto& entry : fs::recursive_directory_iterator(dirname, fs::directory_options::skip_permission_denied)) {
+    if (!entry.is_regular_file()) {
+      continue;
+    }
+    IndexedFile file;
+    auto filename = entry.path().string();
+    if (index) {
+      file.size = entry.file_size();
+      file.mtime = static_cast<int64_t>(entry.last_write_time().time_since_epoch().count());
+      if (auto cached = index->find(filename, file.size, file.mtime)) {
+        file = *cached;
+        file.header.filename = filename;
+        files.emplace_back(filename, std::move(file));
+        continue;
+      }
+    }
+    to_parse.push_back(files.size());
+    files.emplace_back(filename, std::move(file));
+  }
+  parallel_for(to_parse.size(), n_threads, [&](size_t i) {
+    auto& file = files[to_parse[i]];
+    try {
+      file.second.is_dicom = read_slice_header(file.first, file.second.header);
+    }
+    catch (std::exception&) {
+      file.second.is_dicom = false;
+    }
+  });
+  std::vector<SliceHeader> dicoms;
+  for (auto& file : files) {
+    if (file.second.is_dicom) {
+      // the headers are kept for the index, otherwise moved
+      dicoms.push_back(index ? file.second.header : std::move(file.second.header));
+    }
+  }
+  if (index) {
+    index->update(dirname, std::move(files));
+  }
+  return dicoms;
+}
+
+std::vector<SliceHeader> scan_zip(ZipReaderPool& zip, const std::vector<ZipEntry>& entries, unsigned n_threads)
+{
+  constexpr int64_t initial_prefix = 64 * 1024;
+  std::vector<SliceHeader> parsed(entries.size());
+  std::vector<char> is_dicom(entries.size(), 0);
+  parallel_for(entries.size(), n_threads, [&](size_t i) {
+    const auto& entry = entries[i];
+    if (!is_dicom_candidate(entry.name)) {
+      return;
+    }
+    auto reader = zip.acquire();
+    std::vector<char> buffer;
+    for (auto prefix = initial_prefix;; prefix *= 4) {
+      if (reader->read(entry, buffer, prefix) != MZ_OK || !has_dicom_signature(buffer)) {
+        break;
+      }
+      bool whole = static_cast<int64_t>(buffer.size()) >= entry.uncompressed_size;
+      MemoryInputStream is(buffer);
+      SliceHeader header;
+      bool ok = false;
+      try {
+        ok = read_slice_header(is, header);
+      }
+      catch (std::exception&) {
+        ok = false;
+      }
+      if (ok && (whole || is.good())) {
+        header.filename = entry.name;
+        header.entry = static_cast<int64_t>(i);
+        parsed[i] = std::move(header);
+        is_dicom[i] = 1;
+        break;
+      }
+      if (whole) { // not a DICOM image
+        break;
+      }
+    }
+  });
+  std::vector<SliceHeader> headers;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (is_dicom[i]) {
+      headers.push_back(std::move(parsed[i]));
+    }
+  }
+  return headers;
+}
+
+
+bool read_zip_slice(ZipReaderPool& zip, const std::vector<ZipEntry>& entries, const SliceHeader& header, gdcm::ImageReader& reader)
+{
+  std::vector<char> buffer;
+  if (zip.acquire()->read(entries[header.entry], buffer) != MZ_OK) {
+    return false;
+  }
+  MemoryInputStream is(buffer);
+  reader.SetStream(is);
+  return reader.Read();
+}
+
+std::vector<Series> group_series(std::vector<SliceHeader> headers)
+{
+  // Headers are bucketed by index and moved only once, into their series
+  std::vector<size_t> order(headers.size());
+  std::iota(order.begin(), order.end(), size_t(0));
+  std::sort(order.begin(), order.end(), [&headers](size_t a, size_t b) { return headers[a].filename < headers[b].filename; });
+  std::unordered_map<std::string_view, size_t> group_of;
+  std::vector<std::vector<size_t>> groups;
+  for (auto i : order) {
+    auto it = group_of.try_emplace(headers[i].series_identifier, groups.size()).first;
+    if (it->second == groups.size()) {
+      groups.emplace_back();
+    }
+    groups[it->second].push_back(i);
+  }
+  // in the order of the identifiers
+  std::sort(groups.begin(), groups.end(), [&headers](const auto& a, const auto& b) {
+    return headers[a.front()].series_identifier < headers[b.front()].series_identifier;
+  });
+  std::vector<Series> series;
+  series.reserve(groups.size());
+  for (const auto& g : groups) {
+    Series s{ headers[g.front()].series_identifier, {} };
+    s.slices.reserve(g.size());
+    for (auto i : g) {
+      s.slices.push_back(std::move(headers[i]));
+    }
+    order_slices(s.slices);
+    series.push_back(std::move(s));
+  }
+  return series;
+}
+
+std::vector<Series> filter_series(std::vector<Series> series, const SeriesFilter& filter, std::vector<std::string>& excluded)
+{
+  std::regex description;
+  if (!filter.description.empty()) {
+    description = std::regex(filter.description, std::regex::ECMAScript | std::regex::icase);
+  }
+  auto contains = [](const std::vector<std::string>& values, const std::string& value) {
+    return std::find(values.begin(), values.end(), value) != values.end();
+  };
+  auto is_localizer = [](const SliceHeader& h) {
+    std::stringstream ss(h.image_type);
+    std::string value;
+    while (std::getline(ss, value, '\\')) {
+      value = trim(value);
+      if (value == "LOCALIZER" || value == "SCOUT") {
+        return true;
+      }
+    }
+    return false;
+  };
+  std::vector<Series> kept;
+  for (auto& s : series) {
+    const auto& first = s.slices.front();
+    std::string reason;
+    if (!filter.modalities.empty() && !contains(filter.modalities, first.modality)) {
+      reason = "modality " + first.modality;
+    }
+    else if (!filter.series_uids.empty() && !contains(filter.series_uids, first.series_uid)) {
+      reason = "series uid";
+    }
+    else if (uint64_t(first.frames) * s.slices.size() < filter.min_slices) {
+      reason = std::to_string(uint64_t(first.frames) * s.slices.size()) + " slices";
+    }
+    else if (!filter.description.empty() && !std::regex_search(first.description, description)) {
+      reason = "description \"" + first.description + "\"";
+    }
+    else if (filter.exclude_localizers && is_localizer(first)) {
+      reason = "localizer";
+    }
+    if (reason.empty()) {
+      kept.push_back(std::move(s));
+    }
+    else {
+      excluded.push_back(s.identifier + " (" + reason + ")");
+    }
+  }
+  return kept;
+}
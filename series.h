@@ -0,0 +1,110 @@
+#ifndef SERIES_H
+#define SERIES_H
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+#include <gdcmImageReader.h>
+#include "utils.h"
+#include "archive.h"
+
+/// <summary>
+/// Per-file DICOM attributes needed for grouping, sorting and naming.
+/// </summary>
+struct SliceHeader {
+  std::string filename; // path on disk or entry name in the archive
+  int64_t entry = -1;   // index of the zip entry, -1 for plain files
+
+  std::string series_uid;
+  std::string series_identifier; // series uid refined like GDCMSeriesFileNames::SetUseSeriesDetails
+  std::string modality;
+  std::string description;
+  std::string series_number;
+  std::string series_date;
+  std::string image_type; // values separated by backslashes, e.g. ORIGINAL\PRIMARY\LOCALIZER
+  int instance_number = 0;
+  bool has_instance_number = false;
+
+  bool has_position = false;
+  double position[3] = { 0, 0, 0 };
+  double orientation[6] = { 1, 0, 0, 0, 1, 0 };
+
+  unsigned rows = 0;
+  unsigned columns = 0;
+  unsigned frames = 1;
+  unsigned samples_per_pixel = 1;
+  std::string photometric;
+  unsigned bits_allocated = 0;
+  unsigned bits_stored = 0;
+  unsigned high_bit = 0;
+  unsigned pixel_representation = 0;
+  unsigned planar_configuration = 0;
+  std::string transfer_syntax; // UID
+  double slope = 1;
+  double intercept = 0;
+
+  SuvParams suv;         // PET only
+  std::string suv_error; // reason why suv is not available
+};
+
+/// <summary>
+/// Parse DICOM header up to pixel data.
+/// </summary>
+/// <returns>false if the stream is not a DICOM image</returns>
+bool read_slice_header(std::istream& is, SliceHeader& header);
+bool read_slice_header(const std::string& filename, SliceHeader& header);
+
+class HeaderIndex;
+
+/// <summary>
+/// Parse headers of all files under the directory (recursively) on n_threads threads.
+/// Files which are not DICOM images are skipped.
+/// With an index, only new or changed files are parsed and the index is updated with the result.
+/// </summary>
+std::vector<SliceHeader> scan_directory(const std::string& dirname, unsigned n_threads = 0, HeaderIndex* index = nullptr);
+
+/// <summary>
+/// Parse headers of all entries in the archive on n_threads threads, each with its own handle.
+/// Only the beginning of each entry is inflated, and entries which are not DICOM by their name
+/// (e.g. DICOMDIR, .pdf, .jpg) or by their first bytes are skipped.
+/// SliceHeader::entry is the index in entries.
+/// </summary>
+std::vector<SliceHeader> scan_zip(ZipReaderPool& zip, const std::vector<ZipEntry>& entries, unsigned n_threads = 0);
+
+/// <summary>
+/// Inflate the entry of the slice into memory and Read() it with the reader. Thread safe.
+/// </summary>
+bool read_zip_slice(ZipReaderPool& zip, const std::vector<ZipEntry>& entries, const SliceHeader& header, gdcm::ImageReader& reader);
+
+struct Series {
+  std::string identifier;
+  std::vector<SliceHeader> slices; // sorted along the slice normal
+};
+
+/// <summary>
+/// Group slices into series and sort each series in the same manner as itk::GDCMSeriesFileNames
+/// with SetUseSeriesDetails(true) and AddSeriesRestriction("0008|0021").
+/// Series are ordered by their identifiers.
+/// </summary>
+std::vector<Series> group_series(std::vector<SliceHeader> headers);
+
+/// <summary>
+/// Criteria for the series to convert, applied to the parsed headers so that excluded series are never read.
+/// Empty members don't restrict.
+/// </summary>
+struct SeriesFilter {
+  std::vector<std::string> modalities;
+  std::vector<std::string> series_uids;
+  uint64_t min_slices = 0;         // slices (frames) of the series
+  std::string description;         // regular expression (ECMAScript) searched in SeriesDescription, case insensitive
+  bool exclude_localizers = false; // LOCALIZER or SCOUT in ImageType
+};
+
+/// <summary>
+/// Remove series which don't meet the filter. The order of the remaining series is kept.
+/// std::regex_error is thrown if the description is not a valid regular expression.
+/// </summary>
+/// <param name="excluded">identifiers of the removed series, each followed by the reason</param>
+std::vector<Series> filter_series(std::vector<Series> series, const SeriesFilter& filter, std::vector<std::string>& excluded);
+
+#endif /* SERIES_H */
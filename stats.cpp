@@ -0,0 +1,122 @@
+#include "stats.h"
+#include <iomanip>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+double process_cpu_seconds()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  auto to_seconds = [](const FILETIME& ft) {
+    return ((uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) * 1e-7; // 100ns units
+  };
+  return to_seconds(kernel) + to_seconds(user);
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  auto to_seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec * 1e-6; };
+  return to_seconds(usage.ru_utime) + to_seconds(usage.ru_stime);
+#endif
+}
+
+uint64_t peak_rss_bytes()
+{
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return 0;
+  }
+  return counters.PeakWorkingSetSize;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#ifdef __APPLE__
+  return uint64_t(usage.ru_maxrss); // bytes
+#else
+  return uint64_t(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+}
+
+Stats::Stats()
+  : start(std::chrono::steady_clock::now()), start_cpu(process_cpu_seconds())
+{
+}
+
+void Stats::add(const std::string& stage, double wall, double cpu, uint64_t bytes, uint64_t items)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto& s = stages[stage];
+  s.wall += wall;
+  s.cpu += cpu;
+  s.calls += 1;
+  s.bytes += bytes;
+  s.items += items;
+}
+
+void Stats::print(std::ostream& os) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  auto flags = os.flags();
+  os << std::fixed << std::setprecision(3);
+  os << "Stats:" << std::endl;
+  os << std::left << std::setw(10) << "stage" << std::right << std::setw(8) << "calls" << std::setw(12) << "wall[s]"
+    << std::setw(12) << "cpu[s]" << std::setw(12) << "MB" << std::setw(10) << "items" << std::setw(12) << "items/s" << std::setw(10) << "MB/s" << std::endl;
+  for (const auto& s : stages) {
+    const auto& st = s.second;
+    os << std::left << std::setw(10) << s.first << std::right << std::setw(8) << st.calls << std::setw(12) << st.wall
+      << std::setw(12) << st.cpu << std::setw(12) << st.bytes / 1e6 << std::setw(10) << st.items
+      << std::setw(12) << (st.wall > 0 ? st.items / st.wall : 0) << std::setw(10) << (st.wall > 0 ? st.bytes / 1e6 / st.wall : 0) << std::endl;
+  }
+  os << "Total: " << wall << " s wall, " << process_cpu_seconds() - start_cpu << " s cpu, peak RSS " << peak_rss_bytes() / 1e6 << " MB" << std::endl;
+  os.flags(flags);
+}
+
+void Stats::write_json(std::ostream& os) const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  auto precision = os.precision(6);
+  os << "{\"wall_seconds\": " << wall << ", \"cpu_seconds\": " << process_cpu_seconds() - start_cpu
+    << ", \"peak_rss_bytes\": " << peak_rss_bytes() << ", \"stages\": {";
+  bool first = true;
+  for (const auto& s : stages) {
+    const auto& st = s.second;
+    os << (first ? "" : ", ") << "\"" << s.first << "\": {\"calls\": " << st.calls << ", \"wall_seconds\": " << st.wall
+      << ", \"cpu_seconds\": " << st.cpu << ", \"bytes\": " << st.bytes << ", \"items\": " << st.items
+      << ", \"items_per_second\": " << (st.wall > 0 ? st.items / st.wall : 0) << "}";
+    first = false;
+  }
+  os << "}}" << std::endl;
+  os.precision(precision);
+}
+
+StageTimer::StageTimer(Stats* stats, const char* stage)
+  : stats(stats), stage(stage)
+{
+  if (stats) {
+    start = std::chrono::steady_clock::now();
+    start_cpu = process_cpu_seconds();
+  }
+}
+
+StageTimer::~StageTimer()
+{
+  if (stats) {
+    auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats->add(stage, wall, process_cpu_seconds() - start_cpu, bytes, items);
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/// <summary>
+/// CPU time (user + system) of the whole process in seconds
+/// </summary>
+double process_cpu_seconds();
+
+/// <summary>
+/// Peak resident set size (peak working set on Windows) of the process in bytes
+/// </summary>
+uint64_t peak_rss_bytes();
+
+/// <summary>
+/// Per-stage counters shared by all threads. Stages of tasks running in parallel overlap,
+/// so their wall and CPU times may add up to more than the elapsed time.
+/// </summary>
+class Stats
+{
+public:
+  struct Stage {
+    double wall = 0; // seconds
+    double cpu = 0;  // seconds of process CPU time while the stage was running
+    uint64_t calls = 0;
+    uint64_t bytes = 0;
+    uint64_t items = 0; // files or slices
+  };
+
+  Stats();
+  void add(const std::string& stage, double wall, double cpu, uint64_t bytes = 0, uint64_t items = 0);
+  void print(std::ostream& os) const;
+  void write_json(std::ostream& os) const;
+
+private:
+  mutable std::mutex mutex;
+  std::map<std::string, Stage> stages;
+  std::chrono::steady_clock::time_point start;
+  double start_cpu;
+};
+
+/// <summary>
+/// Add the wall and CPU time of its lifetime to a stage. Nothing is recorded when stats is nullptr.
+/// </summary>
+class StageTimer
+{
+public:
+  StageTimer(Stats* stats, const char* stage);
+  ~StageTimer();
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+  uint64_t bytes = 0;
+  uint64_t items = 0;
+
+private:
+  Stats* stats;
+  const char* stage;
+  std::chrono::steady_clock::time_point start;
+  double start_cpu = 0;
+};
+
+#endif /* STATS_H */
@@ -0,0 +1,133 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+ThreadPool::ThreadPool(unsigned n_threads, size_t max_queued)
+  : max_queued(max_queued)
+{
+  if (n_threads == 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < n_threads; ++i) {
+    workers.emplace_back([this]() { work(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  task_cv.notify_all();
+  for (auto& w : workers) {
+    w.join();
+  }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    space_cv.wait(lock, [this]() { return max_queued == 0 || tasks.size() < max_queued; });
+    tasks.push_back(std::move(task));
+  }
+  task_cv.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  done_cv.wait(lock, [this]() { return tasks.empty() && running == 0; });
+}
+
+void ThreadPool::work()
+{
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      task_cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+      if (tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      ++running;
+    }
+    space_cv.notify_one();
+    task();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+    }
+    done_cv.notify_all();
+  }
+}
+
+MemoryBudget::MemoryBudget(uint64_t bytes)
+  : budget(bytes), available(bytes)
+{
+}
+
+uint64_t MemoryBudget::acquire(uint64_t bytes)
+{
+  if (budget == 0) {
+    return 0;
+  }
+  bytes = std::min(bytes, budget);
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return available >= bytes; });
+  available -= bytes;
+  return bytes;
+}
+
+void MemoryBudget::release(uint64_t bytes)
+{
+  if (bytes == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    available += bytes;
+  }
+  cv.notify_all();
+}
+
+void parallel_for(size_t n, unsigned n_threads, const std::function<void(size_t)>& fn)
+{
+  if (n_threads == 0) {
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  n_threads = static_cast<unsigned>(std::min<size_t>(n_threads, n));
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto work = [&]() {
+    for (auto i = next++; i < n && !failed; i = next++) {
+      try {
+        fn(i);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        failed = true;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < n_threads; ++t) {
+    threads.emplace_back(work);
+  }
+  work();
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
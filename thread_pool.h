@@ -0,0 +1,74 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Fixed size worker pool. Tasks are started in the order of submission.
+/// With max_queued, the queue is bounded and submit() blocks while it is full, so that a producer
+/// can't get more than max_queued tasks ahead of the workers (e.g. a stage of a pipeline).
+/// </summary>
+class ThreadPool
+{
+public:
+  /// <param name="n_threads">number of workers. 0 uses all hardware threads</param>
+  /// <param name="max_queued">maximum number of tasks waiting for a worker. 0 means unbounded</param>
+  explicit ThreadPool(unsigned n_threads, size_t max_queued = 0);
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void submit(std::function<void()> task);
+  /// <summary>
+  /// Block until all submitted tasks are finished
+  /// </summary>
+  void wait();
+  size_t size() const { return workers.size(); }
+
+private:
+  void work();
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> tasks;
+  std::mutex mutex;
+  std::condition_variable task_cv;
+  std::condition_variable done_cv;
+  std::condition_variable space_cv;
+  size_t max_queued;
+  size_t running = 0;
+  bool stopping = false;
+};
+
+/// <summary>
+/// Counting semaphore over bytes to keep concurrent tasks within a memory budget.
+/// </summary>
+class MemoryBudget
+{
+public:
+  /// <param name="bytes">budget. 0 means unlimited</param>
+  explicit MemoryBudget(uint64_t bytes);
+  /// <summary>
+  /// Block until the bytes are available. Requests larger than the budget wait for the whole budget.
+  /// </summary>
+  /// <returns>reserved bytes to be passed to release()</returns>
+  uint64_t acquire(uint64_t bytes);
+  void release(uint64_t bytes);
+
+private:
+  uint64_t budget;
+  uint64_t available;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+/// <summary>
+/// Call fn(i) for i in [0, n) on up to n_threads threads including the calling thread.
+/// The first exception thrown by fn is rethrown after all threads have finished.
+/// </summary>
+void parallel_for(size_t n, unsigned n_threads, const std::function<void(size_t)>& fn);
+
+#endif /* THREAD_POOL_H */
@@ -1,5 +1,8 @@
 #include "utils.h"
+#include <algorithm>
 #include <iostream>
+#include <cstdio>
+#include <numeric>
 using std::cout;
 using std::endl;
 
@@ -28,6 +31,13 @@ namespace tags
   gdcm::Tag rescale_slope(0x0028, 0x1053);
 }
 
+const std::set<gdcm::Tag>& suv_tags()
+{
+  static const std::set<gdcm::Tag> suv = {
+    tags::modality, tags::pharma, tags::weight, tags::seriesdate, tags::seriestime, tags::rescale_intercept, tags::rescale_slope };
+  return suv;
+}
+
 std::string format_date(const std::string& str_date)
 {
   auto year = str_date.substr(0, 4);
@@ -50,8 +60,7 @@ time_t datetime2time_t(const std::string& date, const std::string& time)
   return std::mktime(&tm);
 }
 
-double calculate_bw_factor(const gdcm::File& file, bool verbose) {
-  const auto &dataset = file.GetDataSet();
+SuvParams get_suv_params(const gdcm::DataSet& dataset) {
   const auto &data = dataset.GetDataElement(tags::pharma);
   if (data.IsEmpty()) {
     throw std::runtime_error("Phama info (0054, 0016) not found.");
@@ -64,13 +73,23 @@ double calculate_bw_factor(const gdcm::File& file, bool verbose) {
   auto item = seq->GetItem(1);
 
   auto pharma_ds = item.GetNestedDataSet();
-  auto elm = pharma_ds.GetDataElement(tags::dose);
-  auto dose = get_string(pharma_ds, tags::dose);
-  auto halflife = get_string(pharma_ds, tags::halflife);
-  auto pharma_starttime = get_string(pharma_ds, tags::pharma_starttime);
-  auto seriesdate = get_string(dataset, tags::seriesdate);
-  auto seriestime = get_string(dataset, tags::seriestime);
-  auto weight = std::stol(get_string(dataset, tags::weight));
+  SuvParams params;
+  params.dose = get_string(pharma_ds, tags::dose);
+  params.halflife = get_string(pharma_ds, tags::halflife);
+  params.pharma_starttime = get_string(pharma_ds, tags::pharma_starttime);
+  params.seriesdate = get_string(dataset, tags::seriesdate);
+  params.seriestime = get_string(dataset, tags::seriestime);
+  params.weight = get_string(dataset, tags::weight);
+  return params;
+}
+
+double calculate_bw_factor(const SuvParams& params, bool verbose) {
+  const auto& dose = params.dose;
+  const auto& halflife = params.halflife;
+  const auto& pharma_starttime = params.pharma_starttime;
+  const auto& seriesdate = params.seriesdate;
+  const auto& seriestime = params.seriestime;
+  auto weight = std::stol(params.weight);
   auto series_datetime = datetime2time_t(seriesdate, seriestime);
   auto pharma_datetime = datetime2time_t(seriesdate, pharma_starttime);
   auto decay_time = (series_datetime - pharma_datetime);
@@ -94,6 +113,10 @@ double calculate_bw_factor(const gdcm::File& file, bool verbose) {
   return SUVbwScaleFactor;
 }
 
+double calculate_bw_factor(const gdcm::File& file, bool verbose) {
+  return calculate_bw_factor(get_suv_params(file.GetDataSet()), verbose);
+}
+
 void rescale_slope(gdcm::File& dcm, double factor) {
   auto &dataset = dcm.GetDataSet();
   auto intercept = std::stof(get_string(dataset, tags::rescale_intercept));
@@ -116,3 +139,62 @@ void rescale_slope(gdcm::File& dcm, double factor) {
   dataset.Replace(elm);
   dcm.SetDataSet(dataset);
 }
+
+std::string json_string(const std::string& s)
+{
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      }
+      else {
+        out += static_cast<char>(c);
+      }
+    }
+  }
+  out += '"';
+  return out;
+}
+
+uint64_t fnv1a(const std::string& s)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::vector<unsigned> assign_shards(const std::vector<std::string>& keys, const std::vector<uint64_t>& weights, unsigned n_shards)
+{
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), size_t(0));
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return weights[a] != weights[b] ? weights[a] > weights[b] : keys[a] < keys[b];
+  });
+  std::vector<unsigned> shards(keys.size(), 0);
+  std::vector<uint64_t> loads(n_shards, 0);
+  for (auto i : order) {
+    const auto start = static_cast<unsigned>(fnv1a(keys[i]) % n_shards);
+    auto lightest = start;
+    for (unsigned k = 1; k < n_shards; ++k) {
+      auto shard = (start + k) % n_shards;
+      if (loads[shard] < loads[lightest]) {
+        lightest = shard;
+      }
+    }
+    shards[i] = lightest;
+    loads[lightest] += weights[i];
+  }
+  return shards;
+}
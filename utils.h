@@ -1,6 +1,9 @@
 #ifndef UTILS_H
 #define UTILS_H
 #include <gdcmFile.h>
+#include <cstdint>
+#include <set>
+#include <vector>
 
 std::string get_string(const gdcm::DataSet& dataset, const gdcm::Tag& tag);
 
@@ -19,6 +22,31 @@ namespace tags
   extern gdcm::Tag rescale_slope;
 }
 
+/// <summary>
+/// Tags used by get_suv_params, calculate_bw_factor and rescale_slope, and the modality.
+/// Reading only them (gdcm::Reader::ReadSelectedTags) stops the parse before the pixel data.
+/// </summary>
+const std::set<gdcm::Tag>& suv_tags();
+
+/// <summary>
+/// Attributes used to calculate SUVbwScaleFactor
+/// </summary>
+struct SuvParams
+{
+  std::string weight;
+  std::string dose;
+  std::string halflife;
+  std::string pharma_starttime;
+  std::string seriesdate;
+  std::string seriestime;
+};
+
+/// <summary>
+/// Collect SUV attributes. std::runtime_error is thrown when any of them is missing.
+/// </summary>
+SuvParams get_suv_params(const gdcm::DataSet& dataset);
+
+double calculate_bw_factor(const SuvParams& params, bool verbose=false);
 double calculate_bw_factor(const gdcm::File& file, bool verbose=false);
 
 /// <summary>
@@ -28,5 +56,23 @@ double calculate_bw_factor(const gdcm::File& file, bool verbose=false);
 /// <param name="factor"></param>
 void rescale_slope(gdcm::File& dcm, double factor);
 
+/// <summary>
+/// Quoted JSON string with escapes
+/// </summary>
+std::string json_string(const std::string& s);
+
+/// <summary>
+/// 64 bit FNV-1a hash, which is the same on every platform and run
+/// </summary>
+uint64_t fnv1a(const std::string& s);
+
+/// <summary>
+/// Split weighted items into n_shards of similar total weight, identically in every process given the same items.
+/// Heavier items are assigned first, each to the lightest shard. Ties go to the first lightest shard counted
+/// from fnv1a(key) % n_shards, so that items of equal weight are spread by their keys.
+/// </summary>
+/// <returns>shard of each item</returns>
+std::vector<unsigned> assign_shards(const std::vector<std::string>& keys, const std::vector<uint64_t>& weights, unsigned n_shards);
+
 
 #endif /* UTILS_H */
\ No newline at end of file
@@ -0,0 +1,428 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+#include "series.h"
+#include "mapped_file.h"
+#include "rescale_simd.h"
+#include "thread_pool.h"
+#include <itkImage.h>
+#include <itkRGBPixel.h>
+#include <itkRGBAPixel.h>
+#include <gdcmImageReader.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/// <summary>
+/// Set the source (file or stream) of the reader and Read() it.
+/// </summary>
+using SliceReadFn = std::function<bool(const SliceHeader&, gdcm::ImageReader&)>;
+
+template <typename T>
+struct PixelInfo {
+  using Component = T;
+  static constexpr unsigned components = 1;
+};
+template <typename T>
+struct PixelInfo<itk::RGBPixel<T>> {
+  using Component = T;
+  static constexpr unsigned components = 3;
+};
+template <typename T>
+struct PixelInfo<itk::RGBAPixel<T>> {
+  using Component = T;
+  static constexpr unsigned components = 4;
+};
+
+/// <summary>
+/// Whether values of TIn may be out of the range of TOut
+/// </summary>
+template <typename TIn, typename TOut>
+constexpr bool needs_saturation()
+{
+  if constexpr (std::is_floating_point_v<TOut>) {
+    return false;
+  }
+  else {
+    return std::is_floating_point_v<TIn>
+      || double(std::numeric_limits<TIn>::lowest()) < double(std::numeric_limits<TOut>::lowest())
+      || double(std::numeric_limits<TIn>::max()) > double(std::numeric_limits<TOut>::max());
+  }
+}
+
+/// <summary>
+/// Clamp to the range of TOut before the cast, which is undefined for out of range values. NaN becomes the lowest value.
+/// </summary>
+template <typename TOut>
+TOut saturate(double v)
+{
+  constexpr double lo = double(std::numeric_limits<TOut>::lowest());
+  constexpr double hi = double(std::numeric_limits<TOut>::max());
+  return static_cast<TOut>(v >= lo ? (v <= hi ? v : hi) : lo);
+}
+
+/// <summary>
+/// Rescale and convert to TOut. Integer outputs saturate when the values may not fit.
+/// Written as branch free loops over contiguous memory so that they are vectorized.
+/// Rescaling of 16 bit values runs on AVX2 kernels when the CPU supports them (see rescale_simd.h).
+/// </summary>
+template <typename TIn, typename TOut>
+void rescale_copy(const TIn* in, TOut* out, size_t n, double slope, double intercept)
+{
+  if (slope == 1.0 && intercept == 0.0) {
+    if constexpr (needs_saturation<TIn, TOut>()) {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = saturate<TOut>(double(in[i]));
+      }
+    }
+    else {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = static_cast<TOut>(in[i]);
+      }
+    }
+  }
+  else {
+    size_t i = 0;
+    if constexpr (has_avx2_rescale<TIn, TOut>) {
+      i = rescale_copy_avx2(in, out, n, slope, intercept); // the rest is left to the loops below
+    }
+    if constexpr (std::is_floating_point_v<TOut>) {
+      for (; i < n; ++i) {
+        out[i] = static_cast<TOut>(in[i] * slope + intercept);
+      }
+    }
+    else {
+      for (; i < n; ++i) {
+        out[i] = saturate<TOut>(in[i] * slope + intercept);
+      }
+    }
+  }
+}
+
+/// <summary>
+/// Whether the decoded buffer of pf can be used as T without conversion
+/// </summary>
+template <typename T>
+bool is_same_scalar_type(const gdcm::PixelFormat& pf)
+{
+  switch (pf.GetScalarType()) {
+  case gdcm::PixelFormat::UINT8:
+    return std::is_same_v<T, uint8_t>;
+  case gdcm::PixelFormat::INT8:
+    return std::is_same_v<T, int8_t>;
+  case gdcm::PixelFormat::UINT16:
+    return std::is_same_v<T, uint16_t>;
+  case gdcm::PixelFormat::INT16:
+    return std::is_same_v<T, int16_t>;
+  case gdcm::PixelFormat::UINT32:
+    return std::is_same_v<T, uint32_t>;
+  case gdcm::PixelFormat::INT32:
+    return std::is_same_v<T, int32_t>;
+  case gdcm::PixelFormat::FLOAT32:
+    return std::is_same_v<T, float>;
+  case gdcm::PixelFormat::FLOAT64:
+    return std::is_same_v<T, double>;
+  default:
+    return false;
+  }
+}
+
+template <typename TOut>
+void rescale_copy(const gdcm::PixelFormat& pf, const char* in, TOut* out, size_t n, double slope, double intercept)
+{
+  switch (pf.GetScalarType()) {
+  case gdcm::PixelFormat::UINT8:
+    rescale_copy(reinterpret_cast<const uint8_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::INT8:
+    rescale_copy(reinterpret_cast<const int8_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::UINT16:
+    rescale_copy(reinterpret_cast<const uint16_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::INT16:
+    rescale_copy(reinterpret_cast<const int16_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::UINT32:
+    rescale_copy(reinterpret_cast<const uint32_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::INT32:
+    rescale_copy(reinterpret_cast<const int32_t*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::FLOAT32:
+    rescale_copy(reinterpret_cast<const float*>(in), out, n, slope, intercept);
+    break;
+  case gdcm::PixelFormat::FLOAT64:
+    rescale_copy(reinterpret_cast<const double*>(in), out, n, slope, intercept);
+    break;
+  default:
+    throw std::runtime_error(std::string("Unsupported pixel format: ") + pf.GetScalarTypeAsString());
+  }
+}
+
+/// <summary>
+/// Multiply all values by factor in place. Written as a plain loop over contiguous memory so that it is vectorized.
+/// </summary>
+template <typename T>
+void scale_buffer(T* buffer, size_t n, T factor)
+{
+  for (size_t i = 0; i < n; ++i) {
+    buffer[i] *= factor;
+  }
+}
+
+/// <summary>
+/// Copy native (uncompressed) pixel data as stored in the file. Values are byte swapped for big endian
+/// files and the bits above bits_stored are masked (or sign extended) like gdcm does, in chunks small
+/// enough to stay in cache. Aligned little endian data without unused bits is read in place.
+/// </summary>
+template <typename TIn, typename TOut>
+void copy_native(const char* in, TOut* out, size_t n, unsigned bits_stored, bool big_endian, double slope, double intercept)
+{
+  using U = std::make_unsigned_t<TIn>;
+  constexpr unsigned bits = sizeof(TIn) * 8;
+  const bool fixup = bits_stored < bits;
+  if (!fixup && (!big_endian || sizeof(TIn) == 1) && reinterpret_cast<uintptr_t>(in) % alignof(TIn) == 0) {
+    rescale_copy(reinterpret_cast<const TIn*>(in), out, n, slope, intercept);
+    return;
+  }
+  const U mask = fixup ? U((U(1) << bits_stored) - 1) : U(~U(0));
+  const U sign = U(U(1) << (bits_stored - 1));
+  constexpr size_t chunk = 16384;
+  std::vector<U> temp(std::min(chunk, n));
+  for (size_t offset = 0; offset < n; offset += chunk) {
+    const auto m = std::min(chunk, n - offset);
+    std::memcpy(temp.data(), in + offset * sizeof(TIn), m * sizeof(TIn));
+    if constexpr (sizeof(TIn) == 2) {
+      if (big_endian) {
+        for (size_t i = 0; i < m; ++i) {
+          temp[i] = U((temp[i] >> 8) | (temp[i] << 8));
+        }
+      }
+    }
+    else if constexpr (sizeof(TIn) == 4) {
+      if (big_endian) {
+        for (size_t i = 0; i < m; ++i) {
+          auto v = temp[i];
+          temp[i] = (v >> 24) | ((v >> 8) & 0xff00u) | ((v << 8) & 0xff0000u) | (v << 24);
+        }
+      }
+    }
+    if (fixup) {
+      for (size_t i = 0; i < m; ++i) {
+        auto v = U(temp[i] & mask);
+        if constexpr (std::is_signed_v<TIn>) {
+          v = (v & sign) ? U(v | ~mask) : v;
+        }
+        temp[i] = v;
+      }
+    }
+    rescale_copy(reinterpret_cast<const TIn*>(temp.data()), out + offset, m, slope, intercept);
+  }
+}
+
+/// <summary>
+/// Whether the pixel data of the files can be copied from memory mapped files instead of being decoded.
+/// Only native transfer syntaxes and layouts which gdcm returns as stored (apart from byte order) qualify.
+/// </summary>
+inline bool is_mappable(const SliceHeader& h, unsigned components)
+{
+  const bool native = h.transfer_syntax == "1.2.840.10008.1.2" || h.transfer_syntax == "1.2.840.10008.1.2.1"
+    || h.transfer_syntax == "1.2.840.10008.1.2.2";
+  const bool layout = components == 1
+    ? h.photometric == "MONOCHROME2" && (h.bits_allocated == 8 || h.bits_allocated == 16 || h.bits_allocated == 32)
+    : components == 3 && h.photometric == "RGB" && h.planar_configuration == 0 && h.bits_allocated == 8;
+  return native && layout && h.entry < 0 && h.has_position && h.frames == 1 && h.samples_per_pixel == components
+    && h.bits_stored > 0 && h.bits_stored <= h.bits_allocated && h.high_bit + 1 == h.bits_stored;
+}
+
+/// <summary>
+/// Copy the pixel data of a slice with the same encoding as reference from a memory mapped file.
+/// </summary>
+/// <returns>false if the slice has to be decoded by gdcm</returns>
+template <typename TOut>
+bool read_mapped(const SliceHeader& slice, const SliceHeader& reference, TOut* out, size_t n)
+{
+  if (slice.transfer_syntax != reference.transfer_syntax || slice.photometric != reference.photometric
+    || slice.rows != reference.rows || slice.columns != reference.columns || slice.frames != 1
+    || slice.samples_per_pixel != reference.samples_per_pixel || slice.planar_configuration != reference.planar_configuration
+    || slice.bits_allocated != reference.bits_allocated || slice.bits_stored != reference.bits_stored
+    || slice.high_bit != reference.high_bit || slice.pixel_representation != reference.pixel_representation
+    || slice.slope != reference.slope || slice.intercept != reference.intercept || !slice.has_position || slice.entry >= 0) {
+    return false;
+  }
+  MappedFile file(slice.filename);
+  if (!file.data()) {
+    return false;
+  }
+  const bool implicit_vr = slice.transfer_syntax == "1.2.840.10008.1.2";
+  const bool big_endian = slice.transfer_syntax == "1.2.840.10008.1.2.2";
+  auto in = find_pixel_data(file.data(), file.size(), n * (slice.bits_allocated / 8), implicit_vr, big_endian);
+  if (!in) {
+    return false;
+  }
+  const bool is_signed = slice.pixel_representation != 0;
+  switch (slice.bits_allocated) {
+  case 8:
+    is_signed ? copy_native<int8_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept)
+              : copy_native<uint8_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept);
+    break;
+  case 16:
+    is_signed ? copy_native<int16_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept)
+              : copy_native<uint16_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept);
+    break;
+  case 32:
+    is_signed ? copy_native<int32_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept)
+              : copy_native<uint32_t>(in, out, n, slice.bits_stored, big_endian, slice.slope, slice.intercept);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+/// <summary>
+/// Decode a sorted series into a 3D image. Geometry is computed in the same manner as
+/// itk::ImageSeriesReader with ForceOrthogonalDirectionOff.
+/// Files are decoded on n_threads threads, each directly into its z-offset of the output buffer,
+/// so read_slice must be thread safe when n_threads != 1.
+/// With map_files, uncompressed files after the first one are memory mapped and copied into the output
+/// buffer in a single pass (see read_mapped). The first file is always decoded by gdcm and the fast path
+/// is taken only if gdcm agrees with the parsed header on its origin, slope and intercept.
+/// std::runtime_error is thrown for series which can't be handled (e.g. palette color, planar RGB).
+/// </summary>
+template <typename ImageType>
+typename ImageType::Pointer read_volume(const Series& series, const SliceReadFn& read_slice, unsigned n_threads = 1, bool map_files = false)
+{
+  static_assert(ImageType::ImageDimension == 3, "Only 3D images are supported");
+  using Pixel = typename ImageType::PixelType;
+  using Component = typename PixelInfo<Pixel>::Component;
+  constexpr unsigned components = PixelInfo<Pixel>::components;
+
+  const auto& first = series.slices.front();
+  const auto n_files = series.slices.size();
+  if (n_files > 1 && first.frames != 1) {
+    throw std::runtime_error("Multi-frame images in a series of multiple files");
+  }
+  const size_t frame_length = size_t(first.columns) * first.rows * components;
+  const size_t file_length = frame_length * first.frames;
+
+  auto image = ImageType::New();
+  typename ImageType::SizeType size;
+  size[0] = first.columns;
+  size[1] = first.rows;
+  size[2] = n_files * first.frames;
+  typename ImageType::RegionType region;
+  region.SetSize(size);
+  image->SetRegions(region);
+  image->Allocate();
+  auto buffer = reinterpret_cast<Component*>(image->GetBufferPointer());
+
+  std::vector<std::array<double, 3>> origins(n_files);
+  double cosines[6];
+  double spacing[3];
+  double slope = 1.0;
+  double intercept = 0.0;
+  auto decode = [&](size_t i) {
+    const auto& slice = series.slices[i];
+    gdcm::ImageReader reader;
+    if (!read_slice(slice, reader)) {
+      throw std::runtime_error("Could not read: " + slice.filename);
+    }
+    const auto& img = reader.GetImage();
+    const auto frames = img.GetNumberOfDimensions() == 3 ? img.GetDimension(2) : 1;
+    if (img.GetColumns() != first.columns || img.GetRows() != first.rows || frames != first.frames) {
+      throw std::runtime_error("Inconsistent image size: " + slice.filename);
+    }
+    const auto& pf = img.GetPixelFormat();
+    if (pf.GetSamplesPerPixel() != components) {
+      throw std::runtime_error("Unexpected samples per pixel: " + slice.filename);
+    }
+    const auto pi = img.GetPhotometricInterpretation();
+    if (components == 1 && pi != gdcm::PhotometricInterpretation::MONOCHROME2) {
+      throw std::runtime_error(std::string("Unsupported photometric interpretation: ") + pi.GetString());
+    }
+    if (components == 3 && (pi != gdcm::PhotometricInterpretation::RGB || img.GetPlanarConfiguration() != 0)) {
+      throw std::runtime_error(std::string("Unsupported photometric interpretation: ") + pi.GetString());
+    }
+    auto dest = buffer + i * file_length;
+    if (img.GetSlope() == 1.0 && img.GetIntercept() == 0.0 && is_same_scalar_type<Component>(pf)
+      && img.GetBufferLength() == file_length * sizeof(Component)) {
+      // native type: decode in place without the copy
+      if (!img.GetBuffer(reinterpret_cast<char*>(dest))) {
+        throw std::runtime_error("Could not decode: " + slice.filename);
+      }
+    }
+    else {
+      std::vector<char> decoded(img.GetBufferLength());
+      if (!img.GetBuffer(decoded.data())) {
+        throw std::runtime_error("Could not decode: " + slice.filename);
+      }
+      rescale_copy(pf, decoded.data(), dest, file_length, img.GetSlope(), img.GetIntercept());
+    }
+
+    std::copy(img.GetOrigin(), img.GetOrigin() + 3, origins[i].begin());
+    if (i == 0) {
+      std::copy(img.GetDirectionCosines(), img.GetDirectionCosines() + 6, cosines);
+      std::copy(img.GetSpacing(), img.GetSpacing() + 3, spacing);
+      slope = img.GetSlope();
+      intercept = img.GetIntercept();
+    }
+  };
+  decode(0);
+  const bool mapped = map_files && is_mappable(first, components) && slope == first.slope && intercept == first.intercept
+    && std::equal(origins[0].begin(), origins[0].end(), first.position,
+      [](double a, double b) { return std::abs(a - b) < 1e-6; });
+  parallel_for(n_files - 1, n_threads, [&](size_t k) {
+    const auto i = k + 1;
+    const auto& slice = series.slices[i];
+    if (mapped && read_mapped(slice, first, buffer + i * file_length, file_length)) {
+      std::copy(slice.position, slice.position + 3, origins[i].begin());
+    }
+    else {
+      decode(i);
+    }
+  });
+
+  double normal[3] = {
+    cosines[1] * cosines[5] - cosines[2] * cosines[4],
+    cosines[2] * cosines[3] - cosines[0] * cosines[5],
+    cosines[0] * cosines[4] - cosines[1] * cosines[3] };
+  if (n_files > 1) {
+    double d[3];
+    for (int j = 0; j < 3; ++j) {
+      d[j] = origins.back()[j] - origins.front()[j];
+    }
+    auto norm = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    if (norm > 0) {
+      spacing[2] = norm / (n_files - 1);
+      for (int j = 0; j < 3; ++j) {
+        normal[j] = d[j] / norm;
+      }
+    }
+    else {
+      spacing[2] = 1.0;
+    }
+  }
+  typename ImageType::PointType origin;
+  typename ImageType::SpacingType image_spacing;
+  typename ImageType::DirectionType direction;
+  for (int j = 0; j < 3; ++j) {
+    origin[j] = origins.front()[j];
+    image_spacing[j] = spacing[j];
+    direction[j][0] = cosines[j];
+    direction[j][1] = cosines[3 + j];
+    direction[j][2] = normal[j];
+  }
+  image->SetOrigin(origin);
+  image->SetSpacing(image_spacing);
+  image->SetDirection(direction);
+  return image;
+}
+
+#endif /* VOLUME_H */
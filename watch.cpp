@@ -0,0 +1,139 @@
+#include "watch.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+  const std::string state_magic = "dcm2itk-watch\t1";
+
+  bool ends_with(const std::string& s, const std::string& suffix)
+  {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  bool is_ignored(const fs::path& path)
+  {
+    auto name = path.filename().string();
+    return name.empty() || name[0] == '.' || ends_with(name, ".part") || ends_with(name, ".tmp");
+  }
+
+  /// <returns>empty if the input can't be read (e.g. removed while being listed)</returns>
+  std::string signature(const fs::directory_entry& entry)
+  {
+    std::error_code ec;
+    uint64_t n_files = 0;
+    uint64_t bytes = 0;
+    fs::file_time_type latest = fs::file_time_type::min();
+    auto add = [&](const fs::directory_entry& e) {
+      auto size = e.file_size(ec);
+      auto mtime = ec ? latest : e.last_write_time(ec);
+      if (!ec) {
+        ++n_files;
+        bytes += size;
+        latest = std::max(latest, mtime);
+      }
+    };
+    if (entry.is_directory(ec)) {
+      for (fs::recursive_directory_iterator it(entry.path(), fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+          add(*it);
+        }
+      }
+    }
+    else {
+      add(entry);
+    }
+    if (ec || n_files == 0) {
+      return "";
+    }
+    std::ostringstream ss;
+    ss << n_files << ":" << bytes << ":" << latest.time_since_epoch().count();
+    return ss.str();
+  }
+}
+
+InboxWatcher::InboxWatcher(const std::string& inbox, const std::string& state_file, std::chrono::seconds settle)
+  : inbox(fs::absolute(inbox).lexically_normal().string()), state_file(state_file), settle(settle)
+{ // inputs are recorded by absolute path so that the state does not depend on how the inbox is given
+  std::ifstream ifs(state_file, std::ios::binary);
+  std::string line;
+  if (!ifs || !std::getline(ifs, line) || line != state_magic) {
+    return;
+  }
+  while (std::getline(ifs, line)) {
+    // signature, status and path, which is last since it may contain anything but a newline
+    auto first = line.find('\t');
+    auto second = first == std::string::npos ? first : line.find('\t', first + 1);
+    if (second == std::string::npos) {
+      continue;
+    }
+    processed[line.substr(second + 1)] = { line.substr(0, first), line.substr(first + 1, second - first - 1) == "ok" };
+  }
+}
+
+std::vector<InboxEntry> InboxWatcher::poll()
+{
+  const auto now = clock::now();
+  std::vector<InboxEntry> ready;
+  std::map<std::string, Observation> current;
+  std::error_code ec;
+  for (fs::directory_iterator it(inbox, ec), end; !ec && it != end; it.increment(ec)) {
+    const auto& path = it->path();
+    std::error_code type_ec;
+    const bool is_input = it->is_directory(type_ec) || (it->is_regular_file(type_ec) && path.extension() == ".zip");
+    if (!is_input || is_ignored(path)) {
+      continue;
+    }
+    auto key = path.string();
+    auto sig = signature(*it);
+    if (sig.empty()) {
+      continue;
+    }
+    auto seen = observed.find(key);
+    Observation observation{ sig, now };
+    if (seen != observed.end() && seen->second.signature == sig) {
+      observation.since = seen->second.since;
+    }
+    current[key] = observation;
+    auto done = processed.find(key);
+    if (now - observation.since >= settle && (done == processed.end() || done->second.signature != sig)) {
+      ready.push_back({ key, sig });
+    }
+  }
+  if (ec) {
+    throw std::runtime_error("Could not list: " + inbox + " (" + ec.message() + ")");
+  }
+  observed.swap(current); // inputs which have disappeared are forgotten
+  return ready;
+}
+
+void InboxWatcher::done(const InboxEntry& entry, bool succeeded)
+{
+  processed[entry.path] = { entry.signature, succeeded };
+  save();
+}
+
+void InboxWatcher::save() const
+{
+  auto temp = state_file + ".tmp";
+  {
+    std::ofstream ofs(temp, std::ios::binary);
+    ofs << state_magic << '\n';
+    for (const auto& p : processed) {
+      ofs << p.second.signature << '\t' << (p.second.succeeded ? "ok" : "failed") << '\t' << p.first << '\n';
+    }
+    if (!ofs) {
+      throw std::runtime_error("Could not write state: " + temp);
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, state_file, ec);
+  if (ec) {
+    throw std::runtime_error("Could not write state: " + state_file + " (" + ec.message() + ")");
+  }
+}
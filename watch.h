@@ -0,0 +1,55 @@
+#ifndef WATCH_H
+#define WATCH_H
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+struct InboxEntry {
+  std::string path;
+  std::string signature; // file count, total size and latest modification time
+};
+
+/// <summary>
+/// Finds inputs (directories and zip files) in an inbox directory which have stopped changing.
+/// Processed inputs are kept in a state file, so that they are not converted again after a restart
+/// unless their contents change.
+/// </summary>
+class InboxWatcher
+{
+public:
+  /// <param name="settle">time an input must stay unchanged before it is reported</param>
+  InboxWatcher(const std::string& inbox, const std::string& state_file, std::chrono::seconds settle);
+
+  /// <summary>
+  /// Look at the inbox once. Hidden files and names ending with .part or .tmp are ignored.
+  /// </summary>
+  /// <returns>inputs which have settled and have not been processed with the same signature</returns>
+  std::vector<InboxEntry> poll();
+
+  /// <summary>
+  /// Record the input as processed and save the state file. Failed inputs are recorded too and are
+  /// retried only when they change. std::runtime_error is thrown if the state can't be written.
+  /// </summary>
+  void done(const InboxEntry& entry, bool succeeded);
+
+private:
+  using clock = std::chrono::steady_clock;
+  struct Observation {
+    std::string signature;
+    clock::time_point since;
+  };
+  struct Record {
+    std::string signature;
+    bool succeeded;
+  };
+  void save() const;
+
+  std::string inbox;
+  std::string state_file;
+  std::chrono::seconds settle;
+  std::map<std::string, Observation> observed;
+  std::map<std::string, Record> processed;
+};
+
+#endif /* WATCH_H */